@@ -0,0 +1,54 @@
+// Copyright (c) 2021-2022 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_INCLUDE_CATALOG_H_
+#define DUMPER_INCLUDE_CATALOG_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define CATALOG_WORKERS 16 // Reads kept in flight, more than the core count as workers mostly wait on the disk
+
+#define CATALOG_MAGIC 0x474C5443474B5000 // "\0PKGCTLG"
+#define CATALOG_VERSION 1
+
+namespace catalog {
+typedef struct {
+  std::string path;
+  std::string content_id;
+  uint32_t content_type;
+  uint32_t drm_type;
+  uint64_t package_size;
+  std::string version; // APP_VER from param.sfo, VERSION when there is no APP_VER
+  std::string title;   // TITLE from param.sfo
+} entry;
+
+// Binary catalog layout: header, `entry_count` records, then the string table records point into
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size; // sizeof(record), rejects catalogs written by a build with another layout
+  uint64_t entry_count;
+  uint64_t strings_size;
+} header;
+
+typedef struct {
+  uint64_t package_size;
+  uint32_t content_type;
+  uint32_t drm_type;
+  uint32_t path_offset; // Offsets into the string table, every string is NUL terminated
+  uint32_t content_id_offset;
+  uint32_t version_offset;
+  uint32_t title_offset;
+} record;
+
+entry read_entry(const std::string &pkg_path); // Flawfinder: ignore
+// Unreadable packages and directories that cannot be listed go to `failed`, the rest of the tree is still scanned
+std::vector<entry> scan(const std::string &directory, uint32_t worker_count = CATALOG_WORKERS, std::vector<std::string> *failed = nullptr);
+void write_json(const std::vector<entry> &entries, const std::string &output_path);
+void write_binary(const std::vector<entry> &entries, const std::string &output_path);
+std::vector<entry> read_binary(const std::string &catalog_path);
+} // namespace catalog
+
+#endif // DUMPER_INCLUDE_CATALOG_H_
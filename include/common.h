@@ -4,6 +4,7 @@
 #ifndef DUMPER_INCLUDE_COMMON_H_
 #define DUMPER_INCLUDE_COMMON_H_
 
+#include <cstddef>
 #include <filesystem>
 #include <sstream>
 #include <stdexcept>
@@ -30,4 +31,23 @@
     std::cout << compiled_msg.str() << std::endl;                                                                                                       \
   };
 
+// Non-owning view of a contiguous array, used to expose tables in place (ex. over a memory mapped file)
+template <typename T>
+class Span {
+public:
+  Span() : m_data(nullptr), m_size(0) {}
+  Span(T *data, size_t size) : m_data(data), m_size(size) {}
+
+  T *data() const { return m_data; }
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  T *begin() const { return m_data; }
+  T *end() const { return m_data + m_size; }
+  T &operator[](size_t index) const { return m_data[index]; }
+
+private:
+  T *m_data;
+  size_t m_size;
+};
+
 #endif // DUMPER_INCLUDE_COMMON_H_
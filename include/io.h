@@ -0,0 +1,159 @@
+// Copyright (c) 2021-2022 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_INCLUDE_IO_H_
+#define DUMPER_INCLUDE_IO_H_
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define IO_COPY_BUFFER 0x100000
+
+#define IO_SPARSE_BLOCK 0x1000 // Granularity of zero detection, smaller runs of zeros are written out
+
+#define IO_PIPELINE_BUFFERS 4
+#define IO_PIPELINE_BUFFER_SIZE 0x400000
+
+#define IO_DIRECTORY_FDS 256 // Directory descriptors a DirectoryTree keeps open, directories past that are resolved from the root
+
+namespace io {
+enum class CopyMethod {
+  Auto,          // In kernel copy when supported, otherwise Pipeline for large ranges and ReadWrite for the rest
+  CopyFileRange, // In kernel copy, Linux only
+  Sendfile,      // In kernel copy, Linux only (FreeBSD requires a socket destination)
+  ReadWrite,     // pread/pwrite through a user buffer
+  Pipeline,      // Reader thread and writer overlapping through a ring of large buffers
+};
+
+typedef struct {
+  uint64_t input_offset;
+  uint64_t output_offset;
+  uint64_t size;
+} copy_range;
+
+typedef std::function<void(uint64_t bytes)> written_callback;
+
+// Reader thread and ring of IO_PIPELINE_BUFFERS buffers that outlive a single copy, so copying many ranges or files pays for neither again
+// One copy at a time, a thread that copies in parallel with others owns its own
+class Pipeline {
+public:
+  Pipeline();
+  ~Pipeline();
+
+  Pipeline(const Pipeline &) = delete;
+  Pipeline &operator=(const Pipeline &) = delete;
+
+  // `on_written` is called on the calling (writer) thread after each buffer is written out
+  void copy(int input_fd, int output_fd, const std::vector<copy_range> &ranges, const written_callback &on_written = nullptr);
+
+private:
+  void read_chunks();
+
+  std::thread m_reader; // Started by the first copy
+  std::vector<std::vector<unsigned char>> m_buffers;
+  std::vector<copy_range> m_chunks; // Ranges of the current copy cut into buffer sized pieces
+  int m_input_fd;
+  uint64_t m_job; // Bumped by every copy, wakes the reader
+  uint64_t m_filled;
+  uint64_t m_drained;
+  bool m_reading; // Reader is still on the current job, its buffers cannot be reused yet
+  bool m_failed;
+  bool m_stop;
+  std::exception_ptr m_error;
+  std::mutex m_lock;
+  std::condition_variable m_changed;
+};
+
+// Owns a file descriptor, closed on destruction so a throwing constructor or function cannot leak it
+class FileDescriptor {
+public:
+  FileDescriptor();
+  explicit FileDescriptor(int fd);
+  ~FileDescriptor();
+
+  FileDescriptor(const FileDescriptor &) = delete;
+  FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+  void reset(int fd = -1);
+  int get() const;
+  bool is_open() const;
+
+private:
+  int m_fd;
+};
+
+// Read-only mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  void map(int fd);
+  void unmap();
+  bool is_mapped() const;
+  const unsigned char *get_data() const;
+  uint64_t get_size() const;
+
+private:
+  void *m_data;
+  uint64_t m_size;
+};
+
+// Output tree whose directories are created once, files are opened relative to their parent's descriptor
+class DirectoryTree {
+public:
+  DirectoryTree();
+  ~DirectoryTree();
+
+  DirectoryTree(const DirectoryTree &) = delete;
+  DirectoryTree &operator=(const DirectoryTree &) = delete;
+
+  bool open(const std::string &root_path);
+  void close();
+  bool is_open() const;
+  const std::string &get_root() const;
+  bool create(const std::string &path);
+  int open_file(const std::string &path, int flags, mode_t mode = 0666);
+
+private:
+  bool create_locked(const std::string &path);
+  int get_parent_locked(const std::string &path, std::string &name);
+
+  int m_root_fd;
+  std::string m_root;
+  std::unordered_map<std::string, int> m_directories; // Relative path to descriptor, -1 once IO_DIRECTORY_FDS are open
+  size_t m_open_count;
+  std::mutex m_lock;
+};
+
+void pread_all(int fd, void *buffer, size_t size, uint64_t offset);
+void pwrite_all(int fd, const void *buffer, size_t size, uint64_t offset);
+bool preallocate(int fd, uint64_t size);
+uint64_t get_free_space(const std::string &path, uint64_t *block_size = nullptr);
+bool sync_filesystem(const std::string &path);
+bool is_zero(const void *buffer, size_t size);
+uint64_t pwrite_sparse(int fd, const void *buffer, size_t size, uint64_t offset);
+uint64_t __copy_file_range(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size);
+uint64_t __sendfile(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size);
+uint64_t __read_write(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size, std::vector<unsigned char> &buffer);
+uint64_t __pipeline(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size);
+void copy(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size, CopyMethod method, std::vector<unsigned char> &buffer, Pipeline *pipeline = nullptr);
+bool hardlink(const std::string &source_path, const std::string &target_path);
+bool clone(int source_fd, int target_fd);
+bool copy_file(const std::string &input_path, const std::string &output_path, CopyMethod method = CopyMethod::Auto);
+} // namespace io
+
+#endif // DUMPER_INCLUDE_IO_H_
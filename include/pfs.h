@@ -1,13 +1,47 @@
 #ifndef DUMPER_INCLUDE_PFS_H_
 #define DUMPER_INCLUDE_PFS_H_
 
+#include <atomic>
 #include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "common.h"
+#include "io.h"
+#include "pfsc.h"
+#include "progress.h"
+
 #define PFS_MAGIC 0x0B2A330100000000
 
-#define PFS_DUMP_BUFFER 0x4000
+#define PFS_DUMP_BUFFER 0x100000
+#define PFS_PROGRESS_CHUNK 0x1000000 // Largest single copy between progress updates
+
+#define PFS_SMALL_FILE_SIZE 0x10000 // Default extract_options::small_file_size
+#define PFS_BATCH_SIZE 0x100000     // Default extract_options::batch_size
+#define PFS_BATCH_MAX_GAP 0x10000   // Unused bytes a batched read may span between two files
+
+#define PFS_INODE_COMPRESSED 0x1
+
+#define PFS_JOURNAL_MAGIC 0x4C4E524A53465000 // "\0PFSJRNL"
+#define PFS_JOURNAL_VERSION 1
+#define PFS_JOURNAL_CRC 0x1 // journal_record::crc is valid
+#define PFS_JOURNAL_MAX_PATH 0x1000
+#define PFS_JOURNAL_BATCH 1024 // Flushed files whose records wait for a single sync of the output filesystem
+
+#define PFS_INDEX_MAGIC 0x5844495346500000 // "\0\0PFSIDX"
+#define PFS_INDEX_VERSION 1
+
+#define PFS_DIRECT_BLOCKS 12
+#define PFS_INDIRECT_BLOCKS 5
+#define PFS_BLOCK_MAP_SIZE (PFS_DIRECT_BLOCKS + PFS_INDIRECT_BLOCKS)
 
 namespace pfs {
 typedef struct {
@@ -45,6 +79,17 @@ typedef struct {
   uint32_t ib[5];
 } di_d32;
 
+// Structure of arrays with only the inode fields traversal and copying use, indexed by inode number
+// Timestamps, ids and the rest of di_d32 are read from the image on demand by Image::get_inode()
+typedef struct {
+  std::vector<uint16_t> mode;
+  std::vector<uint32_t> flags;
+  std::vector<uint64_t> size;
+  std::vector<uint64_t> size_compressed;
+  std::vector<uint32_t> blocks;
+  std::vector<uint32_t> block_map; // PFS_BLOCK_MAP_SIZE per inode, di_d32::db followed by di_d32::ib
+} inode_store;
+
 typedef struct {
   uint32_t ino;
   uint32_t type;
@@ -52,17 +97,265 @@ typedef struct {
   uint32_t entsize;
 } dirent_t;
 
-extern pfs_header header;
-extern size_t pfs_size;
-extern size_t pfs_copied;
-extern std::vector<di_d32> inodes;
+// Run of physically contiguous blocks
+typedef struct {
+  uint64_t block;
+  uint64_t count;
+} extent;
+
+typedef struct {
+  uint32_t path_offset; // Offset of the NUL terminated path, relative to the image root, in manifest::paths
+  uint32_t ino;
+  uint64_t size;
+  uint32_t first_block;
+  uint32_t type;         // dirent_t type, 2 = file and 3 = directory
+  uint32_t extent_index; // First extent of a file in manifest::extents
+  uint32_t extent_count;
+} manifest_entry;
+
+// Flat listing of the whole image from a single traversal, directories always come before their contents
+typedef struct {
+  std::vector<manifest_entry> entries;
+  std::vector<extent> extents;
+  std::string paths;
+  uint64_t total_size;
+  uint64_t file_count;
+} manifest;
+
+// Unit of work handed to a worker, always a whole file or a whole batch, never part of one
+typedef struct {
+  size_t entry;        // Index into the manifest, or into the batch list when `batch_count` is set
+  uint32_t batch_count; // Number of physically adjacent small files read together, 0 for a single file
+} extract_job;
+
+// Duplicate written by linking to an earlier copy once every extract_job is done
+typedef struct {
+  size_t entry;
+  size_t source;
+} link_job;
+
+// .pfsidx layout: this header, then manifest entries, extents and the path arena, each section 8 byte aligned
+// The layout is native and fixed, so loading is a bounds check and one bulk copy per section rather than a parse
+// It replaces the directory walk only, the inode table is still read when the Image is opened
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t id[2];
+  uint32_t blocksz;
+  uint64_t nblock;
+  uint64_t ndinode;
+  uint64_t ndblock;
+  uint64_t image_size;
+  uint32_t entry_size;  // sizeof(manifest_entry), rejects indexes written by a build with another layout
+  uint32_t extent_size; // sizeof(extent)
+  uint64_t entry_count;
+  uint64_t extent_count;
+  uint64_t paths_size;
+  uint64_t total_size;
+  uint64_t file_count;
+} index_header;
+
+// Identifies the image a journal was written for
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t id[2];
+  uint32_t blocksz;
+  uint64_t ndinode;
+  uint64_t ndblock;
+} journal_header;
+
+// One completed output file, followed by its `path_size` byte path
+// `check` covers the fields before it and the path so a torn append is detected
+typedef struct {
+  uint32_t path_size;
+  uint32_t flags;
+  uint64_t size;
+  unsigned char crc[4];
+  unsigned char check[4];
+} journal_record;
+
+typedef struct {
+  uint32_t worker_count = 1; // 0 uses one worker per hardware thread
+  io::CopyMethod copy_method = io::CopyMethod::Auto;
+  bool memory_map = false; // Parse metadata straight out of a read-only mapping of the image
+  uint32_t decompress_workers = 0; // Threads inflating PFSC blocks, 0 uses one per hardware thread, shared out between extraction workers
+  uint32_t max_inflight_blocks = PFSC_MAX_INFLIGHT_BLOCKS; // Decoded blocks waiting to be written, also shared out between extraction workers
+  bool physical_order = false; // Copy files sorted by their first block so the image is read close to sequentially
+  progress::callback on_progress = nullptr; // Called from a reporting thread every `progress_interval` ms and once at the end
+  uint32_t progress_interval = PROGRESS_INTERVAL;
+  std::string journal_path; // Append-only record of completed files, empty disables it
+  bool resume = false;      // Keep the existing journal and skip files it lists that are still intact on disk
+  bool journal_crc = false; // Read each file back after writing and store its CRC32, checked again on resume, otherwise files are flushed to disk, PFS_JOURNAL_BATCH at a time, before they are journaled
+  bool sparse = false;      // Skip writing all-zero IO_SPARSE_BLOCK pieces, of plain and PFSC compressed files, reads through a buffer or the mapping instead of `copy_method`
+  bool preallocate = false; // Reserve each file's full size before writing it, ignored for sparse output
+  bool check_free_space = false; // Fail before copying anything when the output filesystem is too small
+  bool link_duplicates = false;  // Hardlink, or reflink, further directory entries of an inode to its first copy
+  bool hash_duplicates = false;  // Also link files with different inodes but identical SHA-256, only same sized files are hashed
+  std::vector<std::string> include_paths; // Globs of paths to extract, empty extracts everything
+  std::vector<std::string> exclude_paths; // Globs of paths to skip, wins over include_paths
+  std::string index_path; // .pfsidx sidecar, loaded instead of walking the directory tree, written when missing or stale
+  uint64_t small_file_size = PFS_SMALL_FILE_SIZE; // Uncompressed files up to this size are read together with their neighbours, 0 disables
+  uint64_t batch_size = PFS_BATCH_SIZE;           // Largest single read of a batch of small files
+} extract_options;
+
+// Per worker job deque, owner pops from the front and thieves steal from the back
+typedef struct {
+  std::mutex lock;
+  std::deque<extract_job> jobs;
+} job_queue;
+
+// Include/exclude globs over paths relative to the image root
+// `*` and `?` stay within one path component, `**` crosses them and `[...]` is a character class
+// Patterns are anchored at the image root ("eboot.bin", "sce_sys/"), "**/*.sprx" matches at any depth
+// Anchored patterns let directories no pattern can reach be skipped without reading them
+// A pattern matching a directory selects everything below it
+class PathFilter {
+public:
+  PathFilter();
+  PathFilter(const std::vector<std::string> &include, const std::vector<std::string> &exclude);
+
+  bool is_empty() const;
+  bool is_included(const std::string &path) const;
+  bool is_excluded(const std::string &path) const;
+  bool may_contain(const std::string &directory) const; // Whether anything below `directory` can be included
+
+private:
+  std::vector<std::string> m_include;
+  std::vector<std::string> m_exclude;
+};
+
+bool match_glob(const char *pattern, const char *path);
+
+// Completed file log used to resume an interrupted extraction
+class Journal {
+public:
+  Journal();
+  ~Journal();
+
+  Journal(const Journal &) = delete;
+  Journal &operator=(const Journal &) = delete;
+
+  void open(const std::string &journal_path, const pfs_header &header, bool resume);
+  void close();
+  bool is_open() const;
+  const journal_record *find(const std::string &path) const; // Records loaded when resuming only
+  void append(const std::string &path, uint64_t size, const unsigned char *crc);
+  size_t defer(const std::string &path, uint64_t size); // Held back until commit(), returns how many records are waiting
+  void commit(const std::function<void(const std::vector<std::string> &paths)> &sync); // `sync` makes the files durable before their records are written
+
+private:
+  int m_fd;
+  std::mutex m_lock;
+  uint64_t m_offset;
+  std::vector<std::pair<std::string, uint64_t>> m_pending;
+  std::unordered_map<std::string, journal_record> m_records; // Keyed by output path, links to one inode are journaled separately
+};
+
+class Image;
+
+// Read-only access to one file inside an image without extracting it
+// Not safe to share between threads, open one per thread instead (Image::open itself can be called from several threads)
+class File {
+public:
+  File(const Image &image, std::vector<extent> extents, uint64_t size, uint64_t stored_size, bool compressed); // `stored_size` is the PFSC stream size of a compressed inode
+
+  uint64_t get_size() const;
+  size_t pread(void *buffer, size_t size, uint64_t offset); // Returns less than `size` only at the end of the file
+  size_t read(void *buffer, size_t size); // Flawfinder: ignore
+  void seek(uint64_t position);
+  uint64_t tell() const;
+
+private:
+  const Image *m_image;
+  std::vector<extent> m_extents;
+  uint64_t m_size;
+  uint64_t m_position;
+  std::unique_ptr<pfsc::Stream> m_stream; // Only set for compressed inodes
+};
+
+class Image {
+public:
+  // `image_offset` and `image_size` select an image embedded in a larger file (ex. the PFS image of a PKG), a size of 0 runs to the end of the file
+  explicit Image(const std::string &pfs_path, bool memory_map = false, uint64_t image_offset = 0, uint64_t image_size = 0);
+  ~Image();
+
+  Image(const Image &) = delete;
+  Image &operator=(const Image &) = delete;
+
+  const pfs_header &get_header() const;
+  di_d32 get_inode(uint32_t ino) const;
+  size_t get_inode_count() const;
+  uint16_t get_mode(uint32_t ino) const;
+  uint32_t get_flags(uint32_t ino) const;
+  uint64_t get_size(uint32_t ino) const;
+  uint64_t get_size_compressed(uint32_t ino) const;
+  uint32_t get_block_count(uint32_t ino) const;
+  Span<const uint32_t> get_block_map(uint32_t ino) const;
+  Span<const di_d32> get_inode_block(uint64_t index) const;
+  Span<const unsigned char> get_block(uint64_t block) const;
+  bool is_memory_mapped() const;
+  std::vector<extent> get_extents(uint32_t ino) const;
+  void read(void *buffer, size_t size, uint64_t offset) const; // Flawfinder: ignore
+  void read_file(const manifest_entry &entry, void *buffer, size_t size, uint64_t offset) const; // Flawfinder: ignore
+  const manifest &build_manifest(const PathFilter &filter = PathFilter());
+  bool load_index(const std::string &index_path);
+  void save_index(const std::string &index_path);
+  const char *get_path(const manifest_entry &entry) const;
+  const manifest_entry *find(const std::string &path); // find() and open() may run on several threads at once, but not alongside dump(), build_manifest() or load_index()
+  File open(const std::string &path);
+  uint64_t calculate_size();
+  uint64_t get_copied() const;
+  uint64_t get_deduplicated() const;
+  progress::snapshot get_progress();
+  void dump(const std::string &output_path, const extract_options &options = extract_options());
+
+private:
+  friend class File;
+
+  const unsigned char *get_mapped(uint64_t offset, uint64_t size) const;
+  uint64_t get_inode_offset(uint32_t ino) const;
+  void read_extents(const extent *extents, uint32_t extent_count, void *buffer, size_t size, uint64_t offset) const; // Flawfinder: ignore
+  void map_indirect(uint64_t block, uint32_t depth, uint64_t &remaining, uint64_t &next, std::vector<extent> &extents) const;
+  index_header get_index_header() const;
+  void filter_manifest(const PathFilter &filter);
+  const manifest_entry *find_locked(const std::string &path);
+  void parse_directory(uint32_t ino, uint32_t level, const std::string &path, const PathFilter &filter);
+  std::string hash_file(const manifest_entry &entry, std::vector<unsigned char> &buffer) const;
+  void find_duplicates(std::vector<extract_job> &jobs, std::vector<link_job> &links, const extract_options &options, std::vector<unsigned char> &buffer) const;
+  bool is_complete(io::DirectoryTree &output, const manifest_entry &entry, std::vector<unsigned char> &buffer) const;
+  void copy_file(io::DirectoryTree &output, const manifest_entry &entry, const extract_options &options, std::vector<unsigned char> &buffer, io::Pipeline &pipeline, const unsigned char *data = nullptr);
+  void journal_file(io::DirectoryTree &output, const manifest_entry &entry, const extract_options &options, const unsigned char *crc);
+  void flush_journal(io::DirectoryTree &output);
+  void batch_small_files(std::vector<extract_job> &jobs, const extract_options &options);
+  void run_job(io::DirectoryTree &output, const extract_job &job, const extract_options &options, std::vector<unsigned char> &buffer, std::vector<unsigned char> &arena, io::Pipeline &pipeline);
+  void copy_batch(io::DirectoryTree &output, const extract_job &job, const extract_options &options, std::vector<unsigned char> &buffer, std::vector<unsigned char> &arena, io::Pipeline &pipeline);
+  void link_file(io::DirectoryTree &output, const manifest_entry &entry, const manifest_entry &source, const extract_options &options, std::vector<unsigned char> &buffer, io::Pipeline &pipeline);
+  void copy_extents(int output_fd, const manifest_entry &entry, const extract_options &options, std::vector<unsigned char> &buffer, io::Pipeline &pipeline);
+  void decompress_file(int output_fd, const manifest_entry &entry, const extract_options &options);
+  void run_jobs(io::DirectoryTree &output, std::vector<extract_job> &jobs, const extract_options &options);
 
-extern std::ifstream pfs_input;
+  int m_fd;
+  io::MappedFile m_map;
+  uint64_t m_offset; // Start of the image within the file, every read is relative to it
+  uint64_t m_size;
+  pfs_header m_header;
+  uint64_t m_inodes_per_block;
+  uint64_t m_inode_count;
+  uint32_t m_pointer_size; // Size of a block pointer inside indirect blocks
+  inode_store m_inodes;
+  bool m_manifest_built;
+  bool m_manifest_filtered; // Built with a non-empty PathFilter, rebuilt before being used as a full listing
+  manifest m_manifest;
+  std::vector<size_t> m_batches; // Manifest indexes of batched small files in physical order, ranges of it are extract_jobs
+  std::unordered_map<std::string_view, size_t> m_path_index; // Views into m_manifest.paths, built on the first find()
+  std::mutex m_path_lock;                                    // Serializes find() and open(), which build the manifest and m_path_index on first use
+  progress::Tracker m_progress;
+  std::atomic<uint64_t> m_deduplicated; // Bytes not written because the file was linked to an earlier copy
+  Journal m_journal;
+};
 
-void __parse_directory(uint32_t ino, uint32_t level, const std::string &output_path, bool calculate_only);
-void calculate_pfs_size(uint32_t ino, uint32_t level);
-void dump_pfs(uint32_t ino, uint32_t level, const std::string &output_path);
-void extract(const std::string &pfs_path, const std::string &output_path);
+void extract(const std::string &pfs_path, const std::string &output_path, const extract_options &options = extract_options());
 } // namespace pfs
 
 #endif // DUMPER_INCLUDE_PFS_H_
@@ -0,0 +1,59 @@
+// Copyright (c) 2021-2022 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_INCLUDE_PFSC_H_
+#define DUMPER_INCLUDE_PFSC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#define PFSC_MAGIC 0x43534650
+
+#define PFSC_MAX_INFLIGHT_BLOCKS 16
+#define PFSC_MAX_BLOCK_SIZE 0x1000000 // Larger blocks are rejected rather than allocated, real images use 0x10000
+
+namespace pfsc {
+// Struct from LibOrbisPKG
+typedef struct {
+  uint32_t magic;
+  uint32_t unk_0x04;
+  uint32_t unk_0x08; // 6
+  uint32_t block_size;
+  uint64_t block_size2;
+  uint64_t block_offsets; // Offset of the (block count + 1) uint64 block offset table
+  uint64_t data_start;
+  uint64_t data_length; // Decompressed size
+} PfscHeader;
+
+// Reads `size` bytes at `offset` of the compressed stream, must be safe to call from several threads
+typedef std::function<void(void *buffer, size_t size, uint64_t offset)> reader;
+
+// Called from a single thread with the number of decompressed bytes after each block is written
+typedef std::function<void(uint64_t bytes)> written_callback;
+
+// Random access to the decompressed data, one decoded block is cached so it is not safe to share between threads
+class Stream {
+public:
+  Stream(const reader &read, uint64_t stream_size); // Flawfinder: ignore
+
+  uint64_t get_size() const;
+  void read(void *buffer, size_t size, uint64_t offset); // Flawfinder: ignore
+
+private:
+  reader m_read;
+  PfscHeader m_header;
+  std::vector<uint64_t> m_offsets;
+  uint64_t m_cached_block;
+  std::vector<unsigned char> m_compressed;
+  std::vector<unsigned char> m_block;
+};
+
+bool is_pfsc(const reader &read); // Flawfinder: ignore
+void inflate_block(const std::vector<unsigned char> &input, std::vector<unsigned char> &output, size_t output_size);
+// `sparse` skips writing all-zero pieces of each block (see io::pwrite_sparse), the caller sets the final size
+void decompress(const reader &read, uint64_t stream_size, int output_fd, uint32_t worker_count = 0, uint32_t max_inflight_blocks = PFSC_MAX_INFLIGHT_BLOCKS, const written_callback &on_written = nullptr, bool sparse = false); // Flawfinder: ignore
+} // namespace pfsc
+
+#endif // DUMPER_INCLUDE_PFSC_H_
@@ -1,8 +1,15 @@
 #ifndef DUMPER_INCLUDE_PKG_H_
 #define DUMPER_INCLUDE_PKG_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "io.h"
+#include "pfs.h"
 
 #define PKG_MAGIC 0x7F434E54
 
@@ -71,10 +78,54 @@ typedef struct {
   uint64_t padding;
 } PkgTableEntry;
 
+// One header digest checked by verify()
+typedef struct {
+  std::string name;
+  uint64_t offset;
+  uint64_t size;
+  bool passed;
+  double elapsed; // Seconds until the digest was ready, digests over a common prefix share one pass
+  double rate;    // Bytes per second
+} verify_result;
+
+// Header and entry table parsed once, single entries are then read on demand without extracting the rest
+// Entries are kept in file byte order, the same as PkgTableEntry everywhere else
+class Package {
+public:
+  explicit Package(const std::string &pkg_path, bool memory_map = false);
+
+  Package(const Package &) = delete;
+  Package &operator=(const Package &) = delete;
+
+  const PkgHeader &get_header() const;
+  Span<const PkgTableEntry> get_entries() const;
+  const PkgTableEntry *find(uint32_t id) const;
+  const PkgTableEntry *find(const std::string &name) const;
+  size_t read_entry(uint32_t id, void *buffer, size_t size, uint64_t offset = 0) const; // Returns less than `size` only at the end of the entry
+  std::vector<unsigned char> read_entry(uint32_t id) const;
+  Span<const unsigned char> get_entry_data(uint32_t id) const;
+  Span<const unsigned char> get_data() const;
+  bool is_memory_mapped() const;
+
+private:
+  const PkgTableEntry &get_entry(uint32_t id) const;
+
+  io::FileDescriptor m_fd;
+  io::MappedFile m_map; // Declared after m_fd so it is unmapped first
+  uint64_t m_size;
+  PkgHeader m_header;
+  std::vector<PkgTableEntry> m_entries;
+  std::unordered_map<uint32_t, size_t> m_id_index;
+  std::unordered_map<std::string, size_t> m_name_index;
+};
+
 bool is_pkg(const std::string &path);
 bool is_fpkg(const std::string &path);
 std::string get_entry_name_by_type(uint32_t type);
+bool get_entry_table(const unsigned char *pkg_data, uint64_t pkg_size, Span<const PkgTableEntry> &entries);
 void extract_sc0(const std::string &pkg_path, const std::string &output_path);
+void extract_pfs(const std::string &pkg_path, const std::string &output_path, const pfs::extract_options &options = pfs::extract_options());
+std::vector<verify_result> verify(const std::string &pkg_path);
 } // namespace pkg
 
 #endif // DUMPER_INCLUDE_PKG_H_
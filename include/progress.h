@@ -0,0 +1,64 @@
+// Copyright (c) 2021-2022 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_INCLUDE_PROGRESS_H_
+#define DUMPER_INCLUDE_PROGRESS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#define PROGRESS_AVERAGE_WINDOW 5.0 // Seconds, time constant of the moving average rate
+#define PROGRESS_INTERVAL 500       // Milliseconds between progress callbacks
+
+namespace progress {
+typedef struct {
+  uint64_t bytes_done;
+  uint64_t bytes_total;
+  uint64_t files_done;
+  uint64_t files_total;
+  std::string current_file;
+  double rate;         // MB/s since the previous sample
+  double average_rate; // MB/s, exponential moving average over PROGRESS_AVERAGE_WINDOW
+  double elapsed;      // Seconds since start
+  double eta;          // Seconds, negative while the rate is still unknown
+} snapshot;
+
+typedef std::function<void(const snapshot &state)> callback;
+
+// Counters are lock free so workers can update them per chunk, only the current file name and sampling take a lock
+class Tracker {
+public:
+  Tracker();
+
+  Tracker(const Tracker &) = delete;
+  Tracker &operator=(const Tracker &) = delete;
+
+  void start(uint64_t bytes_total, uint64_t files_total);
+  void add_bytes(uint64_t bytes);
+  void finish_file();
+  void set_current(const std::string &name); // Copied, the caller's string may go away right after
+  uint64_t get_bytes_done() const;
+  snapshot sample();
+
+private:
+  std::atomic<uint64_t> m_bytes_done;
+  std::atomic<uint64_t> m_files_done;
+  uint64_t m_bytes_total;
+  uint64_t m_files_total;
+
+  std::mutex m_current_lock;
+  std::string m_current;
+
+  std::mutex m_sample_lock;
+  std::chrono::steady_clock::time_point m_start;
+  std::chrono::steady_clock::time_point m_last_time;
+  uint64_t m_last_bytes;
+  double m_average_rate;
+};
+} // namespace progress
+
+#endif // DUMPER_INCLUDE_PROGRESS_H_
@@ -4,6 +4,7 @@
 #ifndef DUMPER_INCLUDE_SFO_H_
 #define DUMPER_INCLUDE_SFO_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -36,6 +37,7 @@ typedef struct {
 
 bool is_sfo(const std::string &path);
 std::vector<SfoData> read(const std::string &path);
+std::vector<SfoData> parse(const unsigned char *buffer, size_t size);
 std::vector<std::string> get_keys(const std::vector<SfoData> &data);
 uint16_t get_format(const std::string &key, const std::vector<SfoData> &data);
 uint32_t get_length(const std::string &key, const std::vector<SfoData> &data);
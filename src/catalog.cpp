@@ -0,0 +1,311 @@
+// Copyright (c) 2021-2022 Al Azif
+// License: GPLv3
+
+#include "catalog.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "io.h"
+#include "pkg.h"
+#include "sfo.h"
+
+namespace catalog {
+// Missing keys are normal here (ex. no APP_VER in DLC), unlike sfo::get_value this does not throw
+static std::string get_string(const std::string &key, const std::vector<sfo::SfoData> &data) {
+  for (auto &&sfo_entry : data) {
+    if (sfo_entry.key_name == key) {
+      const char *value = reinterpret_cast<const char *>(sfo_entry.data.data());
+      return std::string(value, strnlen(value, sfo_entry.data.size())); // Flawfinder: ignore
+    }
+  }
+  return "";
+}
+
+static std::string escape_json(const std::string &value) {
+  std::stringstream ss;
+  for (unsigned char c : value) {
+    if (c == '"' || c == '\\') {
+      ss << '\\' << c;
+    } else if (c < 0x20) {
+      ss << "\\u" << std::hex << std::setfill('0') << std::setw(4) << static_cast<uint32_t>(c) << std::dec;
+    } else {
+      ss << c;
+    }
+  }
+  return ss.str();
+}
+
+entry read_entry(const std::string &pkg_path) { // Flawfinder: ignore
+  // Only the header, the entry table and param.sfo are read, a few KB out of what may be a multi-GB file
+  pkg::Package package(pkg_path);
+  const pkg::PkgHeader &header = package.get_header();
+
+  entry result;
+  result.path = pkg_path;
+  result.content_id = std::string(header.content_id, strnlen(header.content_id, sizeof(header.content_id))); // Flawfinder: ignore
+  result.content_type = __builtin_bswap32(header.content_type);
+  result.drm_type = __builtin_bswap32(header.drm_type);
+  result.package_size = __builtin_bswap64(header.package_size);
+
+  if (package.find(0x1000) != nullptr) {
+    std::vector<unsigned char> param = package.read_entry(0x1000); // Flawfinder: ignore
+    std::vector<sfo::SfoData> sfo_data = sfo::parse(param.data(), param.size());
+    result.title = get_string("TITLE", sfo_data);
+    result.version = get_string("APP_VER", sfo_data);
+    if (result.version.empty()) {
+      result.version = get_string("VERSION", sfo_data);
+    }
+  }
+  return result;
+}
+
+std::vector<entry> scan(const std::string &directory, uint32_t worker_count, std::vector<std::string> *failed) {
+  // Check for empty or pure whitespace path
+  if (directory.empty() || std::all_of(directory.begin(), directory.end(), [](char c) { return std::isspace(c); })) {
+    FATAL_ERROR("Empty input path argument!");
+  }
+
+  // Check if directory exists and is directory
+  if (!std::filesystem::is_directory(directory)) {
+    FATAL_ERROR("Input path does not exist or is not a directory!");
+  }
+
+  // Sorted so workers pulling in order keep reads roughly in directory order, which is also the catalog order
+  // Walked one directory at a time, a recursive iterator ends the whole walk on its first error
+  std::vector<std::string> paths;
+  std::vector<std::string> unreadable;
+  std::vector<std::filesystem::path> pending = {directory};
+  while (!pending.empty()) {
+    std::filesystem::path current = pending.back();
+    pending.pop_back();
+
+    std::error_code error;
+    std::filesystem::directory_iterator it(current, std::filesystem::directory_options::skip_permission_denied, error);
+    for (; !error && it != std::filesystem::directory_iterator(); it.increment(error)) {
+      std::error_code entry_error;
+      std::filesystem::file_status status = it->symlink_status(entry_error);
+      if (!entry_error && std::filesystem::is_directory(status)) {
+        pending.push_back(it->path());
+        continue;
+      }
+
+      std::string extension = it->path().extension();
+      std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+      if (!entry_error && extension == ".pkg" && it->is_regular_file(entry_error)) {
+        paths.push_back(it->path());
+      } else if (entry_error && extension == ".pkg") {
+        unreadable.push_back(it->path());
+      }
+    }
+    if (error) {
+      unreadable.push_back(current);
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+
+  if (worker_count == 0) {
+    worker_count = CATALOG_WORKERS;
+  }
+  worker_count = std::max<uint32_t>(1, std::min<uint64_t>(worker_count, paths.size()));
+
+  // Each PKG costs a handful of small reads, several in flight at once let the disk reorder seeks between them
+  std::vector<entry> results(paths.size());
+  std::vector<unsigned char> parsed(paths.size(), 0);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < paths.size(); i = next++) {
+      try {
+        results[i] = read_entry(paths[i]); // Flawfinder: ignore
+        parsed[i] = 1;
+      } catch (...) {
+        // Broken or unreadable packages are reported by path, the rest of the library is still cataloged
+        parsed[i] = 0;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < worker_count; i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &&thread : workers) {
+    thread.join();
+  }
+
+  std::vector<entry> entries;
+  entries.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (parsed[i] != 0) {
+      entries.push_back(std::move(results[i]));
+    } else {
+      unreadable.push_back(paths[i]);
+    }
+  }
+  if (failed != nullptr) {
+    std::sort(unreadable.begin(), unreadable.end());
+    failed->insert(failed->end(), unreadable.begin(), unreadable.end());
+  }
+  return entries;
+}
+
+void write_json(const std::vector<entry> &entries, const std::string &output_path) {
+  std::ofstream output_file(output_path, std::ios::out | std::ios::trunc);
+  if (!output_file || !output_file.good()) {
+    output_file.close();
+    FATAL_ERROR("Cannot open file: " + std::string(output_path));
+  }
+
+  output_file << "[";
+  for (size_t i = 0; i < entries.size(); i++) {
+    const entry &pkg_entry = entries[i];
+    output_file << (i == 0 ? "\n" : ",\n");
+    output_file << "  {\"path\": \"" << escape_json(pkg_entry.path) << "\", ";
+    output_file << "\"content_id\": \"" << escape_json(pkg_entry.content_id) << "\", ";
+    output_file << "\"content_type\": " << pkg_entry.content_type << ", ";
+    output_file << "\"drm_type\": " << pkg_entry.drm_type << ", ";
+    output_file << "\"package_size\": " << pkg_entry.package_size << ", ";
+    output_file << "\"version\": \"" << escape_json(pkg_entry.version) << "\", ";
+    output_file << "\"title\": \"" << escape_json(pkg_entry.title) << "\"}";
+  }
+  output_file << "\n]\n";
+
+  output_file.close();
+  if (!output_file.good()) {
+    FATAL_ERROR("Error writing catalog: " + std::string(output_path));
+  }
+}
+
+void write_binary(const std::vector<entry> &entries, const std::string &output_path) {
+  std::vector<record> records;
+  records.reserve(entries.size());
+  std::string strings;
+  auto add_string = [&](const std::string &value) {
+    uint32_t offset = strings.size();
+    strings.append(value.c_str()); // Stops at an embedded NUL so every string stays terminated where the reader expects
+    strings.push_back('\0');
+    return offset;
+  };
+  for (auto &&pkg_entry : entries) {
+    record temp_record;
+    std::memset(&temp_record, 0, sizeof(temp_record));
+    temp_record.package_size = pkg_entry.package_size;
+    temp_record.content_type = pkg_entry.content_type;
+    temp_record.drm_type = pkg_entry.drm_type;
+    temp_record.path_offset = add_string(pkg_entry.path);
+    temp_record.content_id_offset = add_string(pkg_entry.content_id);
+    temp_record.version_offset = add_string(pkg_entry.version);
+    temp_record.title_offset = add_string(pkg_entry.title);
+    records.push_back(temp_record);
+  }
+
+  header catalog_header;
+  std::memset(&catalog_header, 0, sizeof(catalog_header));
+  catalog_header.magic = CATALOG_MAGIC;
+  catalog_header.version = CATALOG_VERSION;
+  catalog_header.record_size = sizeof(record);
+  catalog_header.entry_count = records.size();
+  catalog_header.strings_size = strings.size();
+
+  // A rescan can be interrupted part way through a large library, the previous catalog stays readable until the new one is complete
+  std::string temporary_path = output_path + ".tmp";
+  int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666); // Flawfinder: ignore
+  if (fd < 0) {
+    FATAL_ERROR("Cannot open file: " + temporary_path);
+  }
+  try {
+    uint64_t records_size = records.size() * sizeof(record);
+    io::pwrite_all(fd, &catalog_header, sizeof(catalog_header), 0);
+    io::pwrite_all(fd, records.data(), records_size, sizeof(catalog_header));
+    io::pwrite_all(fd, strings.data(), strings.size(), sizeof(catalog_header) + records_size);
+  } catch (...) {
+    close(fd);
+    std::filesystem::remove(temporary_path);
+    throw;
+  }
+  if (close(fd) != 0) {
+    FATAL_ERROR("Error closing file: " + temporary_path);
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary_path, output_path, error);
+  if (error) {
+    FATAL_ERROR("Unable to write catalog: " + output_path);
+  }
+}
+
+std::vector<entry> read_binary(const std::string &catalog_path) { // Flawfinder: ignore
+  int fd = open(catalog_path.c_str(), O_RDONLY); // Flawfinder: ignore
+  if (fd < 0) {
+    FATAL_ERROR("Cannot open file: " + catalog_path);
+  }
+
+  std::vector<entry> entries;
+  try {
+    io::MappedFile catalog_map;
+    catalog_map.map(fd);
+    const unsigned char *data = catalog_map.get_data();
+    uint64_t size = catalog_map.get_size();
+
+    header catalog_header;
+    if (size < sizeof(catalog_header)) {
+      FATAL_ERROR("Error reading catalog header!");
+    }
+    std::memcpy(&catalog_header, data, sizeof(catalog_header));
+    if (catalog_header.magic != CATALOG_MAGIC || catalog_header.version != CATALOG_VERSION || catalog_header.record_size != sizeof(record)) {
+      FATAL_ERROR("Input path is not a catalog!");
+    }
+    uint64_t available = size - sizeof(catalog_header);
+    if (catalog_header.entry_count > available / sizeof(record) || catalog_header.strings_size != available - catalog_header.entry_count * sizeof(record)) {
+      FATAL_ERROR("Error reading catalog records!");
+    }
+
+    const char *strings = reinterpret_cast<const char *>(data + sizeof(catalog_header) + catalog_header.entry_count * sizeof(record));
+    auto get_catalog_string = [&](uint32_t offset) {
+      if (offset >= catalog_header.strings_size) {
+        FATAL_ERROR("Error reading catalog strings!");
+      }
+      return std::string(strings + offset, strnlen(strings + offset, catalog_header.strings_size - offset)); // Flawfinder: ignore
+    };
+
+    entries.reserve(catalog_header.entry_count);
+    for (uint64_t i = 0; i < catalog_header.entry_count; i++) {
+      record temp_record;
+      std::memcpy(&temp_record, data + sizeof(catalog_header) + i * sizeof(record), sizeof(temp_record));
+
+      entry pkg_entry;
+      pkg_entry.path = get_catalog_string(temp_record.path_offset);
+      pkg_entry.content_id = get_catalog_string(temp_record.content_id_offset);
+      pkg_entry.content_type = temp_record.content_type;
+      pkg_entry.drm_type = temp_record.drm_type;
+      pkg_entry.package_size = temp_record.package_size;
+      pkg_entry.version = get_catalog_string(temp_record.version_offset);
+      pkg_entry.title = get_catalog_string(temp_record.title_offset);
+      entries.push_back(pkg_entry);
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+
+  return entries;
+}
+} // namespace catalog
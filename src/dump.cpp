@@ -16,6 +16,7 @@
 #include "elf.h"
 #include "fself.h"
 #include "gp4.h"
+#include "io.h"
 #include "npbind.h"
 #include "pfs.h"
 #include "pkg.h"
@@ -53,11 +54,19 @@ void __dump(const std::string &usb_device, const std::string &title_id, const st
     FATAL_ERROR("Unable to create output directory");
   }
 
-  // Check for .dumping semaphore
+  // PFS extraction journal, left behind next to the .dumping semaphore when a dump is interrupted during extraction
+  std::filesystem::path journal_path(usb_device);
+  journal_path /= output_directory + ".journal";
+
+  // Check for .dumping semaphore, resume instead when the interrupted dump left its journal
   std::filesystem::path dumping_semaphore(usb_device);
   dumping_semaphore /= output_directory + ".dumping";
+  bool resume = false;
   if (std::filesystem::exists(dumping_semaphore)) {
-    FATAL_ERROR("This dump is currently dumping or closed unexpectedly! Please delete existing dump to enable dumping.");
+    if (!std::filesystem::is_regular_file(journal_path)) {
+      FATAL_ERROR("This dump is currently dumping or closed unexpectedly! Please delete existing dump to enable dumping.");
+    }
+    resume = true;
   }
 
   // Check for .complete semaphore
@@ -68,10 +77,12 @@ void __dump(const std::string &usb_device, const std::string &title_id, const st
   }
 
   // Create .dumping semaphore
-  std::ofstream dumping_sem_touch(dumping_semaphore);
-  dumping_sem_touch.close();
-  if (std::filesystem::exists(dumping_semaphore)) {
-    FATAL_ERROR("Unable to create dumping semaphore!");
+  if (!resume) {
+    std::ofstream dumping_sem_touch(dumping_semaphore);
+    dumping_sem_touch.close();
+    if (std::filesystem::exists(dumping_semaphore)) {
+      FATAL_ERROR("Unable to create dumping semaphore!");
+    }
   }
 
   // Create "sce_sys" directory in the output directory
@@ -95,7 +106,7 @@ void __dump(const std::string &usb_device, const std::string &title_id, const st
       install_destination /= title_id + "-install.pkg";
 
       // Copy param.sfo
-      if (!std::filesystem::copy_file(install_source, install_destination, std::filesystem::copy_options::overwrite_existing)) {
+      if (!io::copy_file(install_source, install_destination)) {
         FATAL_ERROR("Unable to copy" + std::string(install_source) + " to " + std::string(install_destination));
       }
 
@@ -103,7 +114,7 @@ void __dump(const std::string &usb_device, const std::string &title_id, const st
       param_source /= title_id;
       param_source /= "param.sfo";
 
-      if (!std::filesystem::copy_file(param_source, param_destination, std::filesystem::copy_options::overwrite_existing)) {
+      if (!io::copy_file(param_source, param_destination)) {
         FATAL_ERROR("Unable to copy" + std::string(param_source) + " to " + std::string(param_destination));
       }
     } else {
@@ -167,7 +178,7 @@ void __dump(const std::string &usb_device, const std::string &title_id, const st
         dst /= "trophy" + std::string(zerofill, '0') + std::string(entry.trophy_number.data) + ".trp";
 
         if (std::filesystem::is_regular_file(src)) {
-          if (!std::filesystem::copy_file(src, dst, std::filesystem::copy_options::overwrite_existing)) {
+          if (!io::copy_file(src, dst)) {
             FATAL_ERROR("Unable to copy" + std::string(src) + " to " + std::string(dst));
           }
         }
@@ -186,7 +197,18 @@ void __dump(const std::string &usb_device, const std::string &title_id, const st
     }
     pfs_path /= "pfs_image.dat";
 
-    pfs::extract(pfs_path, output_path);
+    pfs::extract_options pfs_options;
+    pfs_options.journal_path = journal_path;
+    pfs_options.resume = resume;
+    pfs_options.preallocate = true;
+    pfs_options.check_free_space = true;
+    pfs_options.link_duplicates = true;
+    pfs::extract(pfs_path, output_path, pfs_options);
+
+    // The SELF stages below rewrite files the journal lists as complete, a resume past this point would trust them
+    if (std::filesystem::exists(journal_path) && !std::filesystem::remove(journal_path)) {
+      FATAL_ERROR("Unable to delete PFS journal");
+    }
   }
 
   // Generate GP4
@@ -201,6 +223,10 @@ void __dump(const std::string &usb_device, const std::string &title_id, const st
   // Vector of strings for locations of SELF files for decryption
   std::vector<std::string> self_files;
   for (auto &&p : std::filesystem::recursive_directory_iterator(output_path)) {
+    // Copies of the originals and FSELFs are outputs of this stage, not SELFs to process
+    if (p.path().extension() == ".encrypted" || p.path().extension() == ".fself") {
+      continue;
+    }
     if (elf::is_self(p.path())) {
       self_files.push_back(p.path());
     }
@@ -223,7 +249,7 @@ void __dump(const std::string &usb_device, const std::string &title_id, const st
     encrypted_path += ".encrypted";
 
     // Copy original_path to encrypted_path
-    if (!std::filesystem::copy_file(original_path, encrypted_path, std::filesystem::copy_options::overwrite_existing)) {
+    if (!io::copy_file(original_path, encrypted_path)) {
       FATAL_ERROR("Unable to copy" + std::string(original_path) + " to " + std::string(encrypted_path));
     }
 
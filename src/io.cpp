@@ -0,0 +1,637 @@
+// Copyright (c) 2021-2022 Al Azif
+// License: GPLv3
+
+#include "io.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif // __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+namespace io {
+FileDescriptor::FileDescriptor() : m_fd(-1) {}
+
+FileDescriptor::FileDescriptor(int fd) : m_fd(fd) {}
+
+FileDescriptor::~FileDescriptor() {
+  reset();
+}
+
+void FileDescriptor::reset(int fd) {
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+  m_fd = fd;
+}
+
+int FileDescriptor::get() const {
+  return m_fd;
+}
+
+bool FileDescriptor::is_open() const {
+  return m_fd >= 0;
+}
+
+MappedFile::MappedFile() : m_data(nullptr), m_size(0) {}
+
+MappedFile::~MappedFile() {
+  unmap();
+}
+
+void MappedFile::map(int fd) {
+  unmap();
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    FATAL_ERROR("Unable to stat file for mapping!");
+  }
+
+  // mmap() rejects zero length mappings, an empty file is simply an empty view
+  if (st.st_size == 0) {
+    return;
+  }
+
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    FATAL_ERROR("Unable to map file!");
+  }
+
+  m_data = data;
+  m_size = st.st_size;
+}
+
+void MappedFile::unmap() {
+  if (m_data != nullptr) {
+    munmap(m_data, m_size);
+  }
+  m_data = nullptr;
+  m_size = 0;
+}
+
+bool MappedFile::is_mapped() const {
+  return m_data != nullptr;
+}
+
+const unsigned char *MappedFile::get_data() const {
+  return static_cast<const unsigned char *>(m_data);
+}
+
+uint64_t MappedFile::get_size() const {
+  return m_size;
+}
+
+Pipeline::Pipeline() : m_input_fd(-1), m_job(0), m_filled(0), m_drained(0), m_reading(false), m_failed(false), m_stop(false) {}
+
+Pipeline::~Pipeline() {
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_stop = true;
+  }
+  m_changed.notify_all();
+  if (m_reader.joinable()) {
+    m_reader.join();
+  }
+}
+
+void Pipeline::copy(int input_fd, int output_fd, const std::vector<copy_range> &ranges, const written_callback &on_written) {
+  std::unique_lock<std::mutex> guard(m_lock);
+  m_chunks.clear();
+  for (auto &&range : ranges) {
+    for (uint64_t done = 0; done < range.size; done += IO_PIPELINE_BUFFER_SIZE) {
+      m_chunks.push_back({range.input_offset + done, range.output_offset + done, std::min<uint64_t>(IO_PIPELINE_BUFFER_SIZE, range.size - done)});
+    }
+  }
+  if (m_chunks.empty()) {
+    return;
+  }
+
+  if (m_buffers.empty()) {
+    m_buffers.assign(IO_PIPELINE_BUFFERS, std::vector<unsigned char>(IO_PIPELINE_BUFFER_SIZE));
+  }
+  if (!m_reader.joinable()) {
+    m_reader = std::thread(&Pipeline::read_chunks, this);
+  }
+  m_input_fd = input_fd;
+  m_filled = 0;
+  m_drained = 0;
+  m_failed = false;
+  m_error = nullptr;
+  m_reading = true;
+  m_job++;
+  m_changed.notify_all();
+
+  // The reader fills slot `n % IO_PIPELINE_BUFFERS` while this thread writes out the slots behind it
+  for (size_t i = 0; i < m_chunks.size(); i++) {
+    m_changed.wait(guard, [&]() { return m_failed || i < m_filled; });
+    if (m_failed) {
+      break;
+    }
+
+    const copy_range piece = m_chunks[i];
+    guard.unlock();
+    try {
+      pwrite_all(output_fd, &m_buffers[i % IO_PIPELINE_BUFFERS][0], piece.size, piece.output_offset);
+      if (on_written) {
+        on_written(piece.size);
+      }
+    } catch (...) {
+      guard.lock();
+      if (!m_failed) {
+        m_error = std::current_exception();
+        m_failed = true;
+      }
+      m_changed.notify_all();
+      break;
+    }
+    guard.lock();
+    m_drained = i + 1;
+    m_changed.notify_all();
+  }
+
+  // The reader may still be filling a slot after a failure, the ring is only free once it is back to waiting
+  m_changed.wait(guard, [&]() { return !m_reading; });
+  if (m_error) {
+    std::exception_ptr error = m_error;
+    m_error = nullptr;
+    guard.unlock();
+    std::rethrow_exception(error);
+  }
+}
+
+void Pipeline::read_chunks() {
+  uint64_t job = 0;
+  std::unique_lock<std::mutex> guard(m_lock);
+  while (true) {
+    m_changed.wait(guard, [&]() { return m_stop || m_job != job; });
+    if (m_stop) {
+      return;
+    }
+    job = m_job;
+
+    for (size_t i = 0; i < m_chunks.size(); i++) {
+      m_changed.wait(guard, [&]() { return m_failed || i < m_drained + IO_PIPELINE_BUFFERS; });
+      if (m_failed) {
+        break;
+      }
+
+      const copy_range piece = m_chunks[i];
+      guard.unlock();
+      try {
+        pread_all(m_input_fd, &m_buffers[i % IO_PIPELINE_BUFFERS][0], piece.size, piece.input_offset);
+      } catch (...) {
+        guard.lock();
+        if (!m_failed) {
+          m_error = std::current_exception();
+          m_failed = true;
+        }
+        break;
+      }
+      guard.lock();
+      m_filled = i + 1;
+      m_changed.notify_all();
+    }
+
+    m_reading = false;
+    m_changed.notify_all();
+  }
+}
+
+DirectoryTree::DirectoryTree() : m_root_fd(-1), m_open_count(0) {}
+
+DirectoryTree::~DirectoryTree() {
+  close();
+}
+
+bool DirectoryTree::open(const std::string &root_path) {
+  close();
+  m_root_fd = ::open(root_path.c_str(), O_RDONLY | O_DIRECTORY); // Flawfinder: ignore
+  if (m_root_fd < 0) {
+    return false;
+  }
+  m_root = root_path;
+  return true;
+}
+
+void DirectoryTree::close() {
+  std::lock_guard<std::mutex> guard(m_lock);
+  for (auto &&directory : m_directories) {
+    if (directory.second >= 0) {
+      ::close(directory.second);
+    }
+  }
+  m_directories.clear();
+  m_open_count = 0;
+  if (m_root_fd >= 0) {
+    ::close(m_root_fd);
+    m_root_fd = -1;
+  }
+  m_root.clear();
+}
+
+bool DirectoryTree::is_open() const {
+  return m_root_fd >= 0;
+}
+
+const std::string &DirectoryTree::get_root() const {
+  return m_root;
+}
+
+bool DirectoryTree::create(const std::string &path) {
+  std::lock_guard<std::mutex> guard(m_lock);
+  return create_locked(path);
+}
+
+int DirectoryTree::open_file(const std::string &path, int flags, mode_t mode) {
+  std::string name;
+  int parent_fd;
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    parent_fd = get_parent_locked(path, name);
+  }
+  if (parent_fd < 0) {
+    return -1;
+  }
+  return openat(parent_fd, name.c_str(), flags, mode); // Flawfinder: ignore
+}
+
+bool DirectoryTree::create_locked(const std::string &path) {
+  if (m_root_fd < 0) {
+    return false;
+  }
+  if (path.empty() || m_directories.find(path) != m_directories.end()) {
+    return true;
+  }
+
+  // Missing parents are created first, each directory is only ever made once
+  std::string name;
+  int parent_fd = get_parent_locked(path, name);
+  if (parent_fd < 0) {
+    return false;
+  }
+  if (mkdirat(parent_fd, name.c_str(), 0777) != 0 && errno != EEXIST) {
+    return false;
+  }
+
+  int fd = -1;
+  if (m_open_count < IO_DIRECTORY_FDS) {
+    fd = openat(parent_fd, name.c_str(), O_RDONLY | O_DIRECTORY); // Flawfinder: ignore
+    if (fd < 0) {
+      return false;
+    }
+    m_open_count++;
+  } else {
+    // Out of descriptors to keep, the directory is still checked so a file in its place is not mistaken for it
+    struct stat st;
+    if (fstatat(parent_fd, name.c_str(), &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+      return false;
+    }
+  }
+  m_directories.emplace(path, fd);
+  return true;
+}
+
+int DirectoryTree::get_parent_locked(const std::string &path, std::string &name) {
+  size_t separator = path.rfind('/');
+  if (separator == std::string::npos) {
+    name = path;
+    return m_root_fd;
+  }
+
+  std::string parent(path, 0, separator);
+  if (!create_locked(parent)) {
+    return -1;
+  }
+  int parent_fd = m_directories[parent];
+  if (parent_fd < 0) {
+    name = path;
+    return m_root_fd;
+  }
+  name = path.substr(separator + 1);
+  return parent_fd;
+}
+
+void pread_all(int fd, void *buffer, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t read_size = pread(fd, static_cast<unsigned char *>(buffer) + done, size - done, offset + done); // Flawfinder: ignore
+    if (read_size < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read_size <= 0) {
+      FATAL_ERROR("Error reading data!");
+    }
+    done += read_size;
+  }
+}
+
+void pwrite_all(int fd, const void *buffer, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t write_size = pwrite(fd, static_cast<const unsigned char *>(buffer) + done, size - done, offset + done);
+    if (write_size < 0 && errno == EINTR) {
+      continue;
+    }
+    if (write_size <= 0) {
+      FATAL_ERROR("Error writing data!");
+    }
+    done += write_size;
+  }
+}
+
+// Returns false when the filesystem cannot preallocate, running out of space is an error
+bool preallocate(int fd, uint64_t size) {
+  if (size == 0) {
+    return true;
+  }
+
+  int error;
+#if defined(__linux__)
+  // glibc's posix_fallocate falls back to writing zeros, which would write every file twice
+  do {
+    error = fallocate(fd, 0, 0, size) == 0 ? 0 : errno;
+  } while (error == EINTR);
+#else
+  do {
+    error = posix_fallocate(fd, 0, size);
+  } while (error == EINTR);
+#endif
+
+  if (error == ENOSPC) {
+    FATAL_ERROR("Not enough free space to preallocate file!");
+  }
+  return error == 0;
+}
+
+uint64_t get_free_space(const std::string &path, uint64_t *block_size) {
+  struct statvfs st;
+  if (statvfs(path.c_str(), &st) != 0) {
+    FATAL_ERROR("Cannot get free space of: " + path);
+  }
+  if (block_size != nullptr) {
+    *block_size = st.f_frsize;
+  }
+  return static_cast<uint64_t>(st.f_bavail) * st.f_frsize;
+}
+
+// Flushes every file on the filesystem holding `path` in one call, Linux only (syncfs), returns false when it cannot
+bool sync_filesystem(const std::string &path) {
+#if defined(__linux__)
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY); // Flawfinder: ignore
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = syncfs(fd) == 0;
+  close(fd);
+  return synced;
+#else
+  UNUSED(path);
+  return false;
+#endif // __linux__
+}
+
+bool is_zero(const void *buffer, size_t size) {
+  const unsigned char *data = static_cast<const unsigned char *>(buffer);
+
+  // OR whole 64 byte lines together with no early exit inside a line so the compiler can vectorize it
+  size_t done = 0;
+  while (done + 64 <= size) {
+    uint64_t words[8];
+    std::memcpy(words, data + done, sizeof(words));
+    uint64_t line = 0;
+    for (auto &&word : words) {
+      line |= word;
+    }
+    if (line != 0) {
+      return false;
+    }
+    done += 64;
+  }
+
+  for (; done < size; done++) {
+    if (data[done] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes only the IO_SPARSE_BLOCK sized pieces that are not all zeros, the caller sets the final size with ftruncate
+uint64_t pwrite_sparse(int fd, const void *buffer, size_t size, uint64_t offset) {
+  const unsigned char *data = static_cast<const unsigned char *>(buffer);
+  uint64_t skipped = 0;
+
+  // Neighbouring non-zero pieces are coalesced into a single write
+  size_t run_start = 0;
+  size_t run_end = 0;
+  for (size_t pos = 0; pos < size; pos += IO_SPARSE_BLOCK) {
+    size_t piece = std::min<size_t>(IO_SPARSE_BLOCK, size - pos);
+    if (!is_zero(data + pos, piece)) {
+      if (run_end != pos) {
+        run_start = pos;
+      }
+      run_end = pos + piece;
+      continue;
+    }
+
+    if (run_end > run_start) {
+      pwrite_all(fd, data + run_start, run_end - run_start, offset + run_start);
+      run_start = run_end;
+    }
+    skipped += piece;
+  }
+  if (run_end > run_start) {
+    pwrite_all(fd, data + run_start, run_end - run_start, offset + run_start);
+  }
+  return skipped;
+}
+
+// The in kernel copies return how much they managed before hitting an "unsupported" error so the caller can fall back for the remainder
+
+uint64_t __copy_file_range(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size) {
+#if defined(__linux__)
+  uint64_t done = 0;
+  while (done < size) {
+    loff_t in_off = input_offset + done;
+    loff_t out_off = output_offset + done;
+    ssize_t copied = copy_file_range(input_fd, &in_off, output_fd, &out_off, size - done, 0);
+    if (copied < 0 && errno == EINTR) {
+      continue;
+    }
+    if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+      break;
+    }
+    if (copied <= 0) {
+      FATAL_ERROR("Error copying data!");
+    }
+    done += copied;
+  }
+  return done;
+#else
+  UNUSED(input_fd);
+  UNUSED(input_offset);
+  UNUSED(output_fd);
+  UNUSED(output_offset);
+  UNUSED(size);
+  return 0;
+#endif // __linux__
+}
+
+uint64_t __sendfile(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size) {
+#if defined(__linux__)
+  // sendfile() writes at the output's file position
+  if (lseek(output_fd, output_offset, SEEK_SET) < 0) {
+    FATAL_ERROR("Error seeking output!");
+  }
+
+  uint64_t done = 0;
+  while (done < size) {
+    off_t in_off = input_offset + done;
+    ssize_t copied = sendfile(output_fd, input_fd, &in_off, std::min<uint64_t>(size - done, 0x7FFFF000));
+    if (copied < 0 && errno == EINTR) {
+      continue;
+    }
+    if (copied < 0 && (errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      break;
+    }
+    if (copied <= 0) {
+      FATAL_ERROR("Error copying data!");
+    }
+    done += copied;
+  }
+  return done;
+#else
+  UNUSED(input_fd);
+  UNUSED(input_offset);
+  UNUSED(output_fd);
+  UNUSED(output_offset);
+  UNUSED(size);
+  return 0;
+#endif // __linux__
+}
+
+uint64_t __read_write(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size, std::vector<unsigned char> &buffer) {
+  if (buffer.empty()) {
+    buffer.resize(IO_COPY_BUFFER);
+  }
+
+  uint64_t done = 0;
+  while (done < size) {
+    size_t chunk = static_cast<size_t>(std::min<uint64_t>(size - done, buffer.size()));
+    pread_all(input_fd, &buffer[0], chunk, input_offset + done);
+    pwrite_all(output_fd, &buffer[0], chunk, output_offset + done);
+    done += chunk;
+  }
+  return done;
+}
+
+uint64_t __pipeline(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size) {
+  Pipeline pipeline;
+  pipeline.copy(input_fd, output_fd, {{input_offset, output_offset, size}});
+  return size;
+}
+
+void copy(int input_fd, uint64_t input_offset, int output_fd, uint64_t output_offset, uint64_t size, CopyMethod method, std::vector<unsigned char> &buffer, Pipeline *pipeline) {
+  uint64_t done = 0;
+
+  if (method == CopyMethod::Auto || method == CopyMethod::CopyFileRange) {
+    done += __copy_file_range(input_fd, input_offset, output_fd, output_offset, size);
+    if (done < size && method == CopyMethod::CopyFileRange) {
+      FATAL_ERROR("copy_file_range is not supported for this input/output!");
+    }
+  }
+
+  if (done < size && (method == CopyMethod::Auto || method == CopyMethod::Sendfile)) {
+    done += __sendfile(input_fd, input_offset + done, output_fd, output_offset + done, size - done);
+    if (done < size && method == CopyMethod::Sendfile) {
+      FATAL_ERROR("sendfile is not supported for this input/output!");
+    }
+  }
+
+  // A thread only pays for itself once there is more than one buffer's worth to overlap
+  if (done < size && (method == CopyMethod::Pipeline || (method == CopyMethod::Auto && size - done > IO_PIPELINE_BUFFER_SIZE))) {
+    if (pipeline != nullptr) {
+      pipeline->copy(input_fd, output_fd, {{input_offset + done, output_offset + done, size - done}});
+      done = size;
+    } else {
+      done += __pipeline(input_fd, input_offset + done, output_fd, output_offset + done, size - done);
+    }
+  }
+
+  if (done < size) {
+    __read_write(input_fd, input_offset + done, output_fd, output_offset + done, size - done, buffer);
+  }
+}
+
+// Replaces whatever is at `target_path`, returns false when the filesystem has no hardlinks (exFAT, FAT32)
+bool hardlink(const std::string &source_path, const std::string &target_path) {
+  if (unlink(target_path.c_str()) != 0 && errno != ENOENT) {
+    return false;
+  }
+  return link(source_path.c_str(), target_path.c_str()) == 0;
+}
+
+// Shares the source's blocks with the (empty) target copy-on-write, Linux only (Btrfs, XFS)
+bool clone(int source_fd, int target_fd) {
+#if defined(__linux__) && defined(FICLONE)
+  return ioctl(target_fd, FICLONE, source_fd) == 0;
+#else
+  UNUSED(source_fd);
+  UNUSED(target_fd);
+  return false;
+#endif
+}
+
+bool copy_file(const std::string &input_path, const std::string &output_path, CopyMethod method) {
+  int input_fd = open(input_path.c_str(), O_RDONLY); // Flawfinder: ignore
+  if (input_fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(input_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(input_fd);
+    return false;
+  }
+
+  int output_fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666); // Flawfinder: ignore
+  if (output_fd < 0) {
+    close(input_fd);
+    return false;
+  }
+
+  try {
+    std::vector<unsigned char> buffer;
+    copy(input_fd, 0, output_fd, 0, st.st_size, method, buffer);
+  } catch (...) {
+    close(input_fd);
+    close(output_fd);
+    throw;
+  }
+
+  close(input_fd);
+  if (close(output_fd) != 0) {
+    FATAL_ERROR("Error closing file: " + output_path);
+  }
+  return true;
+}
+} // namespace io
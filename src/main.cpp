@@ -5,13 +5,17 @@
 
 #include <gtest/gtest.h>
 
+#include "catalog_test.h"
 #include "dump_test.h"
 #include "elf_test.h"
 #include "fself_test.h"
 #include "gp4_test.h"
+#include "io_test.h"
 #include "npbind_test.h"
 #include "pfs_test.h"
+#include "pfsc_test.h"
 #include "pkg_test.h"
+#include "progress_test.h"
 #include "sfo_test.h"
 
 int main(int argc, char **argv) {
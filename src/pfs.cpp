@@ -3,193 +3,1752 @@
 
 #include "pfs.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <exception>
 #include <filesystem>
-#include <fstream>
 #include <iomanip>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <crc32.h>
+#include <sha256.h>
+
 #include "common.h"
+#include "io.h"
 
 namespace pfs {
-pfs_header header;
-size_t pfs_size;
-size_t pfs_copied;
-std::vector<di_d32> inodes;
+static void record_check(const journal_record &record, const char *path, unsigned char check[CRC32::HashBytes]) {
+  CRC32 crc32;
+  crc32.add(&record, offsetof(journal_record, check));
+  crc32.add(path, record.path_size);
+  crc32.getHash(check);
+}
 
-std::ifstream pfs_input;
+static void file_crc(int fd, uint64_t size, std::vector<unsigned char> &buffer, unsigned char crc[CRC32::HashBytes]) {
+  if (buffer.empty()) {
+    buffer.resize(PFS_DUMP_BUFFER);
+  }
 
-void __parse_directory(uint32_t ino, uint32_t level, const std::string &output_path, bool calculate_only) {
-  for (uint32_t i = 0; i < inodes[ino].blocks; i++) {
-    uint32_t db = inodes[ino].db[0] + i;
-    uint64_t pos = static_cast<uint64_t>(header.blocksz) * db;
-    uint64_t size = inodes[ino].size;
-    uint64_t top = pos + size;
+  CRC32 crc32;
+  for (uint64_t done = 0; done < size;) {
+    size_t chunk = static_cast<size_t>(std::min<uint64_t>(size - done, buffer.size()));
+    io::pread_all(fd, &buffer[0], chunk, done);
+    crc32.add(&buffer[0], chunk);
+    done += chunk;
+  }
+  crc32.getHash(crc);
+}
 
-    while (pos < top) {
-      dirent_t ent;
+static bool match_class(const char *&pattern, char c) {
+  // `pattern` points just past the '[', on success it is left on the closing ']'
+  const char *p = pattern;
+  bool negate = *p == '!' || *p == '^';
+  if (negate) {
+    p++;
+  }
 
-      pfs_input.seekg(pos, pfs_input.beg);
-      pfs_input.read(reinterpret_cast<char *>(&ent), sizeof(ent)); // Flawfinder: ignore
-      if (!pfs_input.good()) {
-        pfs_input.close();
-        FATAL_ERROR("Error reading entry!");
-      }
+  bool matched = false;
+  bool first = true;
+  while (*p != '\0' && (*p != ']' || first)) {
+    char low = *p;
+    char high = low;
+    if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+      high = p[2];
+      p += 2;
+    }
+    if (c >= low && c <= high) {
+      matched = true;
+    }
+    first = false;
+    p++;
+  }
+  if (*p != ']') {
+    return c == '['; // Unterminated class is a literal '['
+  }
+  pattern = p;
+  return matched != negate;
+}
 
-      if (ent.type == 0) {
-        break;
+bool match_glob(const char *pattern, const char *path) {
+  while (*pattern != '\0') {
+    if (pattern[0] == '*' && pattern[1] == '*') {
+      // "**/" also matches no directories at all
+      pattern += 2;
+      if (*pattern == '/' && match_glob(pattern + 1, path)) {
+        return true;
+      }
+      for (const char *p = path;; p++) {
+        if (match_glob(pattern, p)) {
+          return true;
+        }
+        if (*p == '\0') {
+          return false;
+        }
       }
+    }
 
-      std::vector<char> name(ent.namelen);
-      if (level > 0) {
-        pfs_input.seekg(pos + sizeof(dirent_t), pfs_input.beg);
-        pfs_input.read(reinterpret_cast<char *>(&name[0]), name.size()); // Flawfinder: ignore
-        if (!pfs_input.good()) {
-          pfs_input.close();
-          FATAL_ERROR("Error reading entry name!");
+    switch (*pattern) {
+    case '*':
+      pattern++;
+      for (const char *p = path;; p++) {
+        if (match_glob(pattern, p)) {
+          return true;
         }
+        if (*p == '\0' || *p == '/') {
+          return false;
+        }
+      }
+    case '?':
+      if (*path == '\0' || *path == '/') {
+        return false;
+      }
+      break;
+    case '[':
+      if (*path == '\0' || *path == '/') {
+        return false;
+      }
+      pattern++;
+      if (!match_class(pattern, *path)) {
+        return false;
+      }
+      break;
+    case '\\':
+      if (pattern[1] != '\0') {
+        pattern++;
+      }
+      if (*pattern != *path) {
+        return false;
       }
+      break;
+    default:
+      if (*pattern != *path) {
+        return false;
+      }
+      break;
+    }
+    pattern++;
+    path++;
+  }
+  return *path == '\0';
+}
+
+static std::vector<std::string> split_path(const std::string &path) {
+  std::vector<std::string> components;
+  std::string::size_type start = 0;
+  while (start <= path.size()) {
+    std::string::size_type end = path.find('/', start);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    if (end > start) {
+      components.push_back(path.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return components;
+}
 
-      std::filesystem::path new_output_path(output_path);
-      new_output_path /= std::string(name.begin(), name.end());
+// True when `pattern` matches `path` itself or one of the directories it is in, patterns are anchored at the image root
+static bool match_path(const std::string &pattern, const std::string &path) {
+  const char *rooted = pattern.c_str() + (pattern[0] == '/' ? 1 : 0);
+  for (std::string::size_type end = path.find('/'); end != std::string::npos; end = path.find('/', end + 1)) {
+    if (match_glob(rooted, path.substr(0, end).c_str())) {
+      return true;
+    }
+  }
+  return match_glob(rooted, path.c_str());
+}
 
-      if (ent.type == 2 && level > 0) {
-        if (calculate_only) {
-          pfs_size += inodes[ent.ino].size;
-        } else {
-          // Open path
-          std::ofstream output_file(new_output_path, std::ios::out | std::ios::trunc | std::ios::binary);
-          if (!output_file || !output_file.good()) {
-            pfs_input.close();
-            output_file.close();
-            FATAL_ERROR("Cannot open file: " + std::string(new_output_path));
-          }
+// Trailing slashes ("sce_sys/") name the same directory, empty patterns are dropped
+static std::vector<std::string> clean_patterns(const std::vector<std::string> &patterns) {
+  std::vector<std::string> cleaned;
+  for (std::string pattern : patterns) {
+    while (pattern.size() > 1 && pattern.back() == '/') {
+      pattern.pop_back();
+    }
+    if (!pattern.empty()) {
+      cleaned.push_back(pattern);
+    }
+  }
+  return cleaned;
+}
 
-          unsigned char buffer[PFS_DUMP_BUFFER];
-          std::memset(buffer, '\0', sizeof(buffer));
-
-          std::stringstream ss;
-          uint64_t dump_counter = 0;
-
-          pfs_input.seekg(static_cast<uint64_t>(header.blocksz) * inodes[ent.ino].db[0], pfs_input.beg);
-
-          while (dump_counter + sizeof(buffer) <= inodes[ent.ino].size) {
-            pfs_input.read(reinterpret_cast<char *>(&buffer), sizeof(buffer)); // Flawfinder: ignore
-            if (!pfs_input.good()) {
-              pfs_input.close();
-              output_file.close();
-              FATAL_ERROR("Error reading entry data!");
-            }
-            ss.write(reinterpret_cast<const char *>(&buffer), sizeof(buffer));
-            output_file << ss.rdbuf();
-            ss.str(std::string());
-            ss.clear();
-            std::memset(buffer, '\0', sizeof(buffer));
-            pfs_copied += sizeof(buffer);
-            dump_counter += sizeof(buffer);
-          }
+PathFilter::PathFilter() {
+}
 
-          pfs_input.read(reinterpret_cast<char *>(&buffer), inodes[ent.ino].size - dump_counter); // Flawfinder: ignore
-          if (!pfs_input.good()) {
-            pfs_input.close();
-            output_file.close();
-            FATAL_ERROR("Error reading entry data!");
-          }
-          ss.write(reinterpret_cast<const char *>(&buffer), inodes[ent.ino].size - dump_counter);
-          output_file << ss.rdbuf();
-          ss.str(std::string());
-          ss.clear();
-          dump_counter += inodes[ent.ino].size - dump_counter;
-          pfs_copied += inodes[ent.ino].size - dump_counter;
-
-          output_file.close();
-        }
-      } else if (ent.type == 3) {
-        if (!calculate_only) {
-          if (!std::filesystem::is_directory(new_output_path) && !std::filesystem::create_directory(new_output_path)) {
-            pfs_input.close();
-            FATAL_ERROR("Could not create output directory");
-          }
-        }
-        __parse_directory(ent.ino, level + 1, new_output_path, calculate_only);
+PathFilter::PathFilter(const std::vector<std::string> &include, const std::vector<std::string> &exclude) : m_include(clean_patterns(include)), m_exclude(clean_patterns(exclude)) {
+}
+
+bool PathFilter::is_empty() const {
+  return m_include.empty() && m_exclude.empty();
+}
+
+bool PathFilter::is_included(const std::string &path) const {
+  if (m_include.empty()) {
+    return true;
+  }
+  return std::any_of(m_include.begin(), m_include.end(), [&](const std::string &pattern) { return match_path(pattern, path); });
+}
+
+bool PathFilter::is_excluded(const std::string &path) const {
+  return std::any_of(m_exclude.begin(), m_exclude.end(), [&](const std::string &pattern) { return match_path(pattern, path); });
+}
+
+bool PathFilter::may_contain(const std::string &directory) const {
+  if (m_include.empty()) {
+    return true;
+  }
+
+  std::vector<std::string> directory_components = split_path(directory);
+  for (auto &&pattern : m_include) {
+    // Walk the pattern's leading components alongside the directory's, "**" can match anything below
+    std::vector<std::string> pattern_components = split_path(pattern);
+    bool possible = true;
+    for (size_t i = 0; i < directory_components.size() && i < pattern_components.size(); i++) {
+      if (pattern_components[i].find("**") != std::string::npos) {
+        break;
+      }
+      if (!match_glob(pattern_components[i].c_str(), directory_components[i].c_str())) {
+        possible = false;
+        break;
+      }
+    }
+    if (possible) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Journal::Journal() : m_fd(-1), m_offset(0) {
+}
+
+Journal::~Journal() {
+  if (m_fd >= 0) {
+    ::close(m_fd);
+  }
+}
+
+void Journal::open(const std::string &journal_path, const pfs_header &header, bool resume) {
+  close();
+
+  journal_header expected;
+  std::memset(&expected, 0, sizeof(expected));
+  expected.magic = PFS_JOURNAL_MAGIC;
+  expected.version = PFS_JOURNAL_VERSION;
+  expected.id[0] = header.id[0];
+  expected.id[1] = header.id[1];
+  expected.blocksz = header.blocksz;
+  expected.ndinode = header.ndinode;
+  expected.ndblock = header.ndblock;
+
+  int flags = O_RDWR | O_CREAT;
+  if (!resume) {
+    flags |= O_TRUNC;
+  }
+  m_fd = ::open(journal_path.c_str(), flags, 0666); // Flawfinder: ignore
+  if (m_fd < 0) {
+    FATAL_ERROR("Cannot open journal: " + journal_path);
+  }
+
+  try {
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+      FATAL_ERROR("Cannot stat journal: " + journal_path);
+    }
+
+    if (static_cast<uint64_t>(st.st_size) < sizeof(journal_header)) {
+      // New (or never fully started) journal
+      io::pwrite_all(m_fd, &expected, sizeof(expected), 0);
+      m_offset = sizeof(expected);
+    } else {
+      journal_header existing;
+      io::pread_all(m_fd, &existing, sizeof(existing), 0);
+      if (std::memcmp(&existing, &expected, sizeof(existing)) != 0) {
+        FATAL_ERROR("Journal does not belong to this PFS image: " + journal_path);
       }
 
-      pos += ent.entsize;
+      // Stop at the first torn or corrupt record, everything after it is rewritten by the next append
+      m_offset = sizeof(existing);
+      journal_record record;
+      unsigned char check[CRC32::HashBytes];
+      std::string path;
+      while (m_offset + sizeof(record) <= static_cast<uint64_t>(st.st_size)) {
+        io::pread_all(m_fd, &record, sizeof(record), m_offset);
+        if (record.path_size == 0 || record.path_size > PFS_JOURNAL_MAX_PATH || m_offset + sizeof(record) + record.path_size > static_cast<uint64_t>(st.st_size)) {
+          break;
+        }
+        path.resize(record.path_size);
+        io::pread_all(m_fd, &path[0], path.size(), m_offset + sizeof(record));
+        record_check(record, path.data(), check);
+        if (std::memcmp(check, record.check, sizeof(check)) != 0) {
+          break;
+        }
+        m_records[path] = record;
+        m_offset += sizeof(record) + record.path_size;
+      }
+      if (ftruncate(m_fd, m_offset) != 0) {
+        FATAL_ERROR("Error truncating journal: " + journal_path);
+      }
     }
+  } catch (...) {
+    close();
+    throw;
   }
 }
 
-void calculate_pfs_size(uint32_t ino, uint32_t level) {
-  __parse_directory(ino, level, "", true);
+void Journal::close() {
+  if (m_fd >= 0) {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+  m_records.clear();
+  m_pending.clear();
+  m_offset = 0;
 }
 
-void dump_pfs(uint32_t ino, uint32_t level, const std::string &output_path) {
-  __parse_directory(ino, level, output_path, false);
+bool Journal::is_open() const {
+  return m_fd >= 0;
 }
 
-void extract(const std::string &pfs_path, const std::string &output_path) {
-  // Make sure output directory path exists or can be created
-  if (!std::filesystem::is_directory(output_path) && !std::filesystem::create_directories(output_path)) {
-    pfs_input.close();
-    FATAL_ERROR("Unable to open/create output directory");
+const journal_record *Journal::find(const std::string &path) const {
+  auto record = m_records.find(path);
+  if (record == m_records.end()) {
+    return nullptr;
+  }
+  return &record->second;
+}
+
+void Journal::append(const std::string &path, uint64_t size, const unsigned char *crc) {
+  if (path.empty() || path.size() > PFS_JOURNAL_MAX_PATH) {
+    FATAL_ERROR("Path cannot be journaled: " + path);
+  }
+
+  // Record and path go out in one write, a write that is cut short only ever damages the last record
+  std::vector<unsigned char> data(sizeof(journal_record) + path.size());
+  journal_record record;
+  std::memset(&record, 0, sizeof(record));
+  record.path_size = path.size();
+  record.size = size;
+  if (crc != nullptr) {
+    record.flags |= PFS_JOURNAL_CRC;
+    std::memcpy(record.crc, crc, sizeof(record.crc));
+  }
+  record_check(record, path.data(), record.check);
+  std::memcpy(&data[0], &record, sizeof(record));
+  std::memcpy(&data[sizeof(record)], path.data(), path.size());
+
+  std::lock_guard<std::mutex> guard(m_lock);
+  io::pwrite_all(m_fd, &data[0], data.size(), m_offset);
+  m_offset += data.size();
+}
+
+size_t Journal::defer(const std::string &path, uint64_t size) {
+  std::lock_guard<std::mutex> guard(m_lock);
+  m_pending.push_back({path, size});
+  return m_pending.size();
+}
+
+void Journal::commit(const std::function<void(const std::vector<std::string> &paths)> &sync) {
+  std::vector<std::pair<std::string, uint64_t>> batch;
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    batch.swap(m_pending);
+  }
+  if (batch.empty()) {
+    return;
+  }
+
+  // Other workers keep deferring while this batch is synced, their files go out with the next one
+  std::vector<std::string> paths;
+  paths.reserve(batch.size());
+  for (auto &&pending : batch) {
+    paths.push_back(pending.first);
+  }
+  sync(paths);
+  for (auto &&pending : batch) {
+    append(pending.first, pending.second, nullptr);
+  }
+}
+File::File(const Image &image, std::vector<extent> extents, uint64_t size, uint64_t stored_size, bool compressed) : m_image(&image), m_extents(std::move(extents)), m_size(size), m_position(0) {
+  if (compressed) {
+    // The reader keeps its own copy of the extents so the File stays movable
+    const Image *source = m_image;
+    std::vector<extent> runs = m_extents;
+    pfsc::reader reader = [source, runs](void *buffer, size_t length, uint64_t offset) { source->read_extents(runs.data(), runs.size(), buffer, length, offset); }; // Flawfinder: ignore
+    if (!pfsc::is_pfsc(reader)) {
+      FATAL_ERROR("Compressed inode does not contain PFSC data!");
+    }
+    m_stream = std::make_unique<pfsc::Stream>(reader, stored_size);
+  }
+}
+
+uint64_t File::get_size() const {
+  return m_size;
+}
+
+size_t File::pread(void *buffer, size_t size, uint64_t offset) {
+  if (offset >= m_size) {
+    return 0;
+  }
+  size = std::min<uint64_t>(size, m_size - offset);
+
+  if (!m_stream) {
+    m_image->read_extents(m_extents.data(), m_extents.size(), buffer, size, offset); // Flawfinder: ignore
+    return size;
   }
 
+  // The inode size is authoritative, anything past the end of the PFSC data reads as zeros like an extracted file
+  size_t stored = 0;
+  if (offset < m_stream->get_size()) {
+    stored = std::min<uint64_t>(size, m_stream->get_size() - offset);
+    m_stream->read(buffer, stored, offset); // Flawfinder: ignore
+  }
+  std::memset(static_cast<unsigned char *>(buffer) + stored, 0, size - stored);
+  return size;
+}
+
+size_t File::read(void *buffer, size_t size) { // Flawfinder: ignore
+  size_t done = pread(buffer, size, m_position);
+  m_position += done;
+  return done;
+}
+
+void File::seek(uint64_t position) {
+  m_position = position;
+}
+
+uint64_t File::tell() const {
+  return m_position;
+}
+
+Image::Image(const std::string &pfs_path, bool memory_map, uint64_t image_offset, uint64_t image_size) : m_fd(-1), m_offset(image_offset), m_size(image_size), m_inodes_per_block(0), m_inode_count(0), m_pointer_size(sizeof(uint32_t)), m_manifest_built(false), m_manifest_filtered(false), m_deduplicated(0) {
   // Check for empty or pure whitespace path
   if (pfs_path.empty() || std::all_of(pfs_path.begin(), pfs_path.end(), [](char c) { return std::isspace(c); })) {
-    pfs_input.close();
     FATAL_ERROR("Empty input path argument!");
   }
 
   // Check if file exists and is file
   if (!std::filesystem::is_regular_file(pfs_path)) {
-    pfs_input.close();
     FATAL_ERROR("Input path does not exist or is not a file!");
   }
 
   // Open path
-  pfs_input.open(pfs_path, std::ios::in | std::ios::binary);
-  if (!pfs_input || !pfs_input.good()) {
-    pfs_input.close();
+  m_fd = ::open(pfs_path.c_str(), O_RDONLY); // Flawfinder: ignore
+  if (m_fd < 0) {
     FATAL_ERROR("Cannot open file: " + std::string(pfs_path));
   }
 
-  // Check file magic (Read in whole header)
-  pfs_input.read(reinterpret_cast<char *>(&header), sizeof(header)); // Flawfinder: ignore
-  if (!pfs_input.good()) {
-    pfs_input.close();
-    FATAL_ERROR("Error reading header!");
+  // Everything below can throw, the destructor does not run for a partially constructed object
+  try {
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+      FATAL_ERROR("Unable to stat PFS image!");
+    }
+    uint64_t file_size = st.st_size;
+    if (m_offset > file_size || m_size > file_size - m_offset) {
+      FATAL_ERROR("Image range is outside of the file!");
+    }
+    if (m_size == 0) {
+      m_size = file_size - m_offset;
+    }
+
+    // An embedded image maps the whole file, offsets are adjusted on every access instead
+    if (memory_map) {
+      m_map.map(m_fd);
+    }
+
+    // Check file magic (Read in whole header)
+    read(&m_header, sizeof(m_header), 0); // Flawfinder: ignore
+    if (__builtin_bswap64(m_header.magic) != PFS_MAGIC) {
+      std::stringstream ss;
+      ss << "File magic does not match pfs_image.dat! Expected: 0x" << std::uppercase << std::setfill('0') << std::setw(16) << std::hex << PFS_MAGIC << " | Actual: 0x" << std::uppercase << std::setfill('0') << std::setw(16) << std::hex << __builtin_bswap64(m_header.magic);
+      FATAL_ERROR(ss.str());
+    }
+
+    m_inodes_per_block = m_header.blocksz / sizeof(di_d32);
+    m_inode_count = std::min<uint64_t>(m_header.ndinode, m_header.ndinodeblock * m_inodes_per_block);
+
+    // The inode table must fit in the image before anything is sized from its header counts
+    if (m_header.blocksz == 0 || m_header.ndinodeblock >= m_size / m_header.blocksz) {
+      FATAL_ERROR("Error reading inodes!");
+    }
+
+    // Keep only the hot fields, one inode block at a time (straight out of the mapping when there is one)
+    m_inodes.mode.resize(m_inode_count);
+    m_inodes.flags.resize(m_inode_count);
+    m_inodes.size.resize(m_inode_count);
+    m_inodes.size_compressed.resize(m_inode_count);
+    m_inodes.blocks.resize(m_inode_count);
+    m_inodes.block_map.resize(m_inode_count * PFS_BLOCK_MAP_SIZE);
+
+    std::vector<di_d32> buffer;
+    for (uint64_t i = 0; i * m_inodes_per_block < m_inode_count; i++) {
+      Span<const di_d32> block;
+      if (m_map.is_mapped()) {
+        block = get_inode_block(i);
+      } else {
+        buffer.resize(std::min<uint64_t>(m_inodes_per_block, m_inode_count - i * m_inodes_per_block));
+        read(&buffer[0], buffer.size() * sizeof(di_d32), static_cast<uint64_t>(m_header.blocksz) * (i + 1)); // Flawfinder: ignore
+        block = Span<const di_d32>(buffer.data(), buffer.size());
+      }
+
+      uint64_t ino = i * m_inodes_per_block;
+      for (auto &&inode : block) {
+        m_inodes.mode[ino] = inode.mode;
+        m_inodes.flags[ino] = inode.flags;
+        m_inodes.size[ino] = inode.size;
+        m_inodes.size_compressed[ino] = inode.size_compressed;
+        m_inodes.blocks[ino] = inode.blocks;
+        std::memcpy(&m_inodes.block_map[ino * PFS_BLOCK_MAP_SIZE], inode.db, sizeof(inode.db));
+        std::memcpy(&m_inodes.block_map[ino * PFS_BLOCK_MAP_SIZE + PFS_DIRECT_BLOCKS], inode.ib, sizeof(inode.ib));
+        ino++;
+      }
+    }
+  } catch (...) {
+    m_map.unmap();
+    close(m_fd);
+    throw;
+  }
+}
+
+Image::~Image() {
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+const pfs_header &Image::get_header() const {
+  return m_header;
+}
+
+uint64_t Image::get_inode_offset(uint32_t ino) const {
+  if (ino >= m_inode_count) {
+    FATAL_ERROR("Inode index out of range!");
+  }
+  return static_cast<uint64_t>(m_header.blocksz) * (ino / m_inodes_per_block + 1) + sizeof(di_d32) * (ino % m_inodes_per_block);
+}
+
+di_d32 Image::get_inode(uint32_t ino) const {
+  di_d32 inode;
+  read(&inode, sizeof(inode), get_inode_offset(ino)); // Flawfinder: ignore
+  return inode;
+}
+
+size_t Image::get_inode_count() const {
+  return m_inode_count;
+}
+
+uint16_t Image::get_mode(uint32_t ino) const {
+  get_inode_offset(ino);
+  return m_inodes.mode[ino];
+}
+
+uint32_t Image::get_flags(uint32_t ino) const {
+  get_inode_offset(ino);
+  return m_inodes.flags[ino];
+}
+
+uint64_t Image::get_size(uint32_t ino) const {
+  get_inode_offset(ino);
+  return m_inodes.size[ino];
+}
+
+uint64_t Image::get_size_compressed(uint32_t ino) const {
+  get_inode_offset(ino);
+  return m_inodes.size_compressed[ino];
+}
+
+uint32_t Image::get_block_count(uint32_t ino) const {
+  get_inode_offset(ino);
+  return m_inodes.blocks[ino];
+}
+
+Span<const uint32_t> Image::get_block_map(uint32_t ino) const {
+  get_inode_offset(ino);
+  return Span<const uint32_t>(&m_inodes.block_map[static_cast<uint64_t>(ino) * PFS_BLOCK_MAP_SIZE], PFS_BLOCK_MAP_SIZE);
+}
+
+Span<const di_d32> Image::get_inode_block(uint64_t index) const {
+  if (!m_map.is_mapped()) {
+    FATAL_ERROR("Image is not memory mapped!");
+  }
+
+  // Inode blocks are padded at the end, so the table is only contiguous one block at a time
+  if (index >= m_header.ndinodeblock || index * m_inodes_per_block >= m_inode_count) {
+    FATAL_ERROR("Inode block index out of range!");
+  }
+  size_t count = std::min<uint64_t>(m_inodes_per_block, m_inode_count - index * m_inodes_per_block);
+  return Span<const di_d32>(reinterpret_cast<const di_d32 *>(get_mapped(static_cast<uint64_t>(m_header.blocksz) * (index + 1), count * sizeof(di_d32))), count);
+}
+
+Span<const unsigned char> Image::get_block(uint64_t block) const {
+  if (!m_map.is_mapped()) {
+    FATAL_ERROR("Image is not memory mapped!");
+  }
+  return Span<const unsigned char>(get_mapped(static_cast<uint64_t>(m_header.blocksz) * block, m_header.blocksz), m_header.blocksz);
+}
+
+bool Image::is_memory_mapped() const {
+  return m_map.is_mapped();
+}
+
+// Append a block to the extent list, growing the last extent when it is physically contiguous
+static void add_blocks(std::vector<extent> &extents, uint64_t block, uint64_t count) {
+  if (!extents.empty() && extents.back().block + extents.back().count == block) {
+    extents.back().count += count;
+  } else {
+    extents.push_back({block, count});
+  }
+}
+
+std::vector<extent> Image::get_extents(uint32_t ino) const {
+  Span<const uint32_t> map = get_block_map(ino);
+  const uint32_t *db = map.data();
+  const uint32_t *ib = map.data() + PFS_DIRECT_BLOCKS;
+
+  std::vector<extent> extents;
+  uint64_t remaining = get_block_count(ino);
+  uint64_t next = db[0];
+
+  // A zero pointer is taken as "continues where the previous block left off", images that only record db[0] stay contiguous as before
+  for (uint32_t i = 0; i < PFS_DIRECT_BLOCKS && remaining > 0; i++) {
+    uint64_t block = (i == 0 || db[i] != 0) ? db[i] : next;
+    add_blocks(extents, block, 1);
+    next = block + 1;
+    remaining--;
+  }
+
+  // ib[0] is single indirect, ib[1] double indirect, etc.
+  for (uint32_t i = 0; i < PFS_INDIRECT_BLOCKS && remaining > 0; i++) {
+    if (ib[i] == 0) {
+      break;
+    }
+    map_indirect(ib[i], i, remaining, next, extents);
+  }
+
+  if (remaining > 0) {
+    add_blocks(extents, next, remaining);
+  }
+
+  return extents;
+}
+
+void Image::map_indirect(uint64_t block, uint32_t depth, uint64_t &remaining, uint64_t &next, std::vector<extent> &extents) const {
+  std::vector<unsigned char> pointers(m_header.blocksz);
+  read(&pointers[0], pointers.size(), static_cast<uint64_t>(m_header.blocksz) * block); // Flawfinder: ignore
+
+  for (uint64_t offset = 0; offset + m_pointer_size <= pointers.size() && remaining > 0; offset += m_pointer_size) {
+    uint64_t pointer = 0;
+    std::memcpy(&pointer, &pointers[offset], m_pointer_size);
+
+    if (depth > 0) {
+      if (pointer == 0) {
+        return;
+      }
+      map_indirect(pointer, depth - 1, remaining, next, extents);
+    } else {
+      uint64_t data_block = pointer != 0 ? pointer : next;
+      add_blocks(extents, data_block, 1);
+      next = data_block + 1;
+      remaining--;
+    }
+  }
+}
+
+void Image::read(void *buffer, size_t size, uint64_t offset) const { // Flawfinder: ignore
+  if (m_map.is_mapped()) {
+    std::memcpy(buffer, get_mapped(offset, size), size);
+    return;
+  }
+
+  if (offset > m_size || size > m_size - offset) {
+    FATAL_ERROR("Error reading image data!");
+  }
+
+  // Positioned reads do not share a file offset so any thread can call this at the same time
+  io::pread_all(m_fd, buffer, size, m_offset + offset);
+}
+
+void Image::read_file(const manifest_entry &entry, void *buffer, size_t size, uint64_t offset) const { // Flawfinder: ignore
+  read_extents(m_manifest.extents.data() + entry.extent_index, entry.extent_count, buffer, size, offset); // Flawfinder: ignore
+}
+
+void Image::read_extents(const extent *extents, uint32_t extent_count, void *buffer, size_t size, uint64_t offset) const { // Flawfinder: ignore
+  // Translate a file offset into physical reads, one per extent touched
+  unsigned char *output = static_cast<unsigned char *>(buffer);
+  uint64_t extent_start = 0;
+  for (uint32_t i = 0; i < extent_count && size > 0; i++) {
+    const extent &run = extents[i];
+    uint64_t extent_length = static_cast<uint64_t>(m_header.blocksz) * run.count;
+    if (offset < extent_start + extent_length) {
+      uint64_t within = offset - extent_start;
+      size_t length = std::min<uint64_t>(size, extent_length - within);
+      read(output, length, static_cast<uint64_t>(m_header.blocksz) * run.block + within); // Flawfinder: ignore
+      output += length;
+      offset += length;
+      size -= length;
+    }
+    extent_start += extent_length;
+  }
+  if (size > 0) {
+    FATAL_ERROR("Read past the end of the file's block map!");
+  }
+}
+
+const unsigned char *Image::get_mapped(uint64_t offset, uint64_t size) const {
+  if (offset > m_size || size > m_size - offset) {
+    FATAL_ERROR("Error reading image data!");
+  }
+  return m_map.get_data() + m_offset + offset;
+}
+
+const manifest &Image::build_manifest(const PathFilter &filter) {
+  // A full listing that is already in memory (walked or loaded from an index) is filtered without touching the image again
+  if (!filter.is_empty() && m_manifest_built && !m_manifest_filtered) {
+    filter_manifest(filter);
+    m_manifest_filtered = true;
+    return m_manifest;
+  }
+
+  // A filtered listing is never cached, the next filter is likely to be different
+  if (!m_manifest_built || m_manifest_filtered || !filter.is_empty()) {
+    m_path_index.clear();
+    m_manifest.entries.clear();
+    m_manifest.extents.clear();
+    m_manifest.paths.clear();
+    m_manifest.total_size = 0;
+    m_manifest.file_count = 0;
+
+    parse_directory(m_header.superroot_ino, 0, "", filter);
+    m_manifest_built = true;
+    m_manifest_filtered = !filter.is_empty();
+  }
+  return m_manifest;
+}
+
+const char *Image::get_path(const manifest_entry &entry) const {
+  return m_manifest.paths.c_str() + entry.path_offset;
+}
+
+index_header Image::get_index_header() const {
+  index_header header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = PFS_INDEX_MAGIC;
+  header.version = PFS_INDEX_VERSION;
+  header.id[0] = m_header.id[0];
+  header.id[1] = m_header.id[1];
+  header.blocksz = m_header.blocksz;
+  header.nblock = m_header.nblock;
+  header.ndinode = m_header.ndinode;
+  header.ndblock = m_header.ndblock;
+  header.image_size = m_size;
+  header.entry_size = sizeof(manifest_entry);
+  header.extent_size = sizeof(extent);
+  return header;
+}
+
+static uint64_t align_index(uint64_t offset) {
+  return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+// A missing, stale or damaged index is not an error, the caller walks the image instead
+// Index paths become output paths, anything that could leave the output directory is damage
+static bool is_relative_path(const char *path) {
+  if (*path == '\0' || *path == '/') {
+    return false;
+  }
+  for (const char *start = path;; start++) {
+    const char *end = std::strchr(start, '/');
+    size_t length = end == nullptr ? std::strlen(start) : static_cast<size_t>(end - start); // Flawfinder: ignore
+    if (length == 0 || (length == 1 && start[0] == '.') || (length == 2 && start[0] == '.' && start[1] == '.')) {
+      return false;
+    }
+    if (end == nullptr) {
+      return true;
+    }
+    start = end;
+  }
+}
+
+bool Image::load_index(const std::string &index_path) {
+  if (!std::filesystem::is_regular_file(index_path)) {
+    return false;
+  }
+
+  int fd = ::open(index_path.c_str(), O_RDONLY); // Flawfinder: ignore
+  if (fd < 0) {
+    return false;
+  }
+  io::MappedFile index;
+  try {
+    index.map(fd);
+  } catch (...) {
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  index_header expected = get_index_header();
+  if (index.get_size() < sizeof(index_header)) {
+    return false;
+  }
+  index_header header;
+  std::memcpy(&header, index.get_data(), sizeof(header));
+  if (std::memcmp(&header, &expected, offsetof(index_header, entry_count)) != 0) {
+    return false;
+  }
+
+  uint64_t entries_offset = align_index(sizeof(index_header));
+  uint64_t extents_offset = align_index(entries_offset + header.entry_count * sizeof(manifest_entry));
+  uint64_t paths_offset = align_index(extents_offset + header.extent_count * sizeof(extent));
+  if (header.entry_count > index.get_size() / sizeof(manifest_entry) || header.extent_count > index.get_size() / sizeof(extent) || header.paths_size > index.get_size() || paths_offset + header.paths_size > index.get_size()) {
+    return false;
+  }
+
+  const manifest_entry *entries = reinterpret_cast<const manifest_entry *>(index.get_data() + entries_offset);
+  const extent *extents = reinterpret_cast<const extent *>(index.get_data() + extents_offset);
+  const char *paths = reinterpret_cast<const char *>(index.get_data() + paths_offset);
+
+  // Every reference has to land inside the index before any of it is trusted
+  if (header.paths_size != 0 && paths[header.paths_size - 1] != '\0') {
+    return false;
+  }
+  for (uint64_t i = 0; i < header.entry_count; i++) {
+    if (entries[i].path_offset >= header.paths_size || static_cast<uint64_t>(entries[i].extent_index) + entries[i].extent_count > header.extent_count || entries[i].ino >= m_inode_count || !is_relative_path(paths + entries[i].path_offset)) {
+      return false;
+    }
+  }
+
+  // Copied out rather than used in place, the manifest owns its storage and may be rebuilt or filtered later
+  m_path_index.clear();
+  m_manifest.entries.assign(entries, entries + header.entry_count);
+  m_manifest.extents.assign(extents, extents + header.extent_count);
+  m_manifest.paths.assign(paths, header.paths_size);
+  m_manifest.total_size = header.total_size;
+  m_manifest.file_count = header.file_count;
+  m_manifest_built = true;
+  m_manifest_filtered = false;
+  return true;
+}
+
+void Image::save_index(const std::string &index_path) {
+  const manifest &listing = build_manifest();
+
+  index_header header = get_index_header();
+  header.entry_count = listing.entries.size();
+  header.extent_count = listing.extents.size();
+  header.paths_size = listing.paths.size();
+  header.total_size = listing.total_size;
+  header.file_count = listing.file_count;
+
+  uint64_t entries_offset = align_index(sizeof(index_header));
+  uint64_t extents_offset = align_index(entries_offset + header.entry_count * sizeof(manifest_entry));
+  uint64_t paths_offset = align_index(extents_offset + header.extent_count * sizeof(extent));
+
+  // Written next to the final name and renamed over it, a reader never sees a half written index
+  std::string temporary_path = index_path + ".tmp";
+  int fd = ::open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666); // Flawfinder: ignore
+  if (fd < 0) {
+    FATAL_ERROR("Cannot open file: " + temporary_path);
+  }
+  try {
+    io::pwrite_all(fd, &header, sizeof(header), 0);
+    io::pwrite_all(fd, listing.entries.data(), listing.entries.size() * sizeof(manifest_entry), entries_offset);
+    io::pwrite_all(fd, listing.extents.data(), listing.extents.size() * sizeof(extent), extents_offset);
+    io::pwrite_all(fd, listing.paths.data(), listing.paths.size(), paths_offset);
+    if (ftruncate(fd, paths_offset + listing.paths.size()) != 0) {
+      FATAL_ERROR("Error setting file size: " + temporary_path);
+    }
+  } catch (...) {
+    close(fd);
+    std::filesystem::remove(temporary_path);
+    throw;
+  }
+  if (close(fd) != 0) {
+    FATAL_ERROR("Error closing file: " + temporary_path);
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary_path, index_path, error);
+  if (error) {
+    FATAL_ERROR("Unable to write PFS index: " + index_path);
+  }
+}
+
+void Image::filter_manifest(const PathFilter &filter) {
+  // Entries are in tree order, so the directories a path is in are always on `open_directories`
+  std::vector<bool> keep(m_manifest.entries.size(), false);
+  std::vector<size_t> open_directories;
+  for (size_t i = 0; i < m_manifest.entries.size(); i++) {
+    const manifest_entry &entry = m_manifest.entries[i];
+    std::string path(get_path(entry));
+    while (!open_directories.empty()) {
+      std::string parent(get_path(m_manifest.entries[open_directories.back()]));
+      if (path.compare(0, parent.size() + 1, parent + '/') == 0) {
+        break;
+      }
+      open_directories.pop_back();
+    }
+
+    keep[i] = filter.is_included(path) && !filter.is_excluded(path);
+    if (keep[i]) {
+      for (auto &&directory : open_directories) {
+        keep[directory] = true;
+      }
+    }
+    if (entry.type == 3) {
+      open_directories.push_back(i);
+    }
+  }
+
+  manifest filtered;
+  filtered.total_size = 0;
+  filtered.file_count = 0;
+  for (size_t i = 0; i < m_manifest.entries.size(); i++) {
+    if (!keep[i]) {
+      continue;
+    }
+    manifest_entry entry = m_manifest.entries[i];
+    const char *path = get_path(entry);
+    entry.path_offset = filtered.paths.size();
+    filtered.paths.append(path);
+    filtered.paths.push_back('\0');
+    if (entry.type == 2) {
+      filtered.extents.insert(filtered.extents.end(), m_manifest.extents.begin() + entry.extent_index, m_manifest.extents.begin() + entry.extent_index + entry.extent_count);
+      entry.extent_index = filtered.extents.size() - entry.extent_count;
+      filtered.total_size += entry.size;
+      filtered.file_count++;
+    }
+    filtered.entries.push_back(entry);
+  }
+
+  m_path_index.clear();
+  m_manifest = std::move(filtered);
+}
+
+const manifest_entry *Image::find(const std::string &path) {
+  std::lock_guard<std::mutex> guard(m_path_lock);
+  return find_locked(path);
+}
+
+const manifest_entry *Image::find_locked(const std::string &path) {
+  const manifest &listing = build_manifest();
+  if (m_path_index.empty()) {
+    m_path_index.reserve(listing.entries.size());
+    for (size_t i = 0; i < listing.entries.size(); i++) {
+      m_path_index.emplace(get_path(listing.entries[i]), i);
+    }
+  }
+
+  // Paths are relative to the image root, "/eboot.bin" and "sce_sys/" are accepted too
+  std::string_view key(path);
+  while (!key.empty() && key.front() == '/') {
+    key.remove_prefix(1);
+  }
+  while (!key.empty() && key.back() == '/') {
+    key.remove_suffix(1);
+  }
+
+  auto found = m_path_index.find(key);
+  if (found == m_path_index.end()) {
+    return nullptr;
+  }
+  return &listing.entries[found->second];
+}
+
+File Image::open(const std::string &path) {
+  std::vector<extent> extents;
+  uint64_t size;
+  uint32_t ino;
+  {
+    std::lock_guard<std::mutex> guard(m_path_lock);
+    const manifest_entry *entry = find_locked(path);
+    if (entry == nullptr) {
+      FATAL_ERROR("File does not exist in PFS image: " + path);
+    }
+    if (entry->type != 2) {
+      FATAL_ERROR("Path is not a file: " + path);
+    }
+    extents.assign(m_manifest.extents.begin() + entry->extent_index, m_manifest.extents.begin() + entry->extent_index + entry->extent_count);
+    size = entry->size;
+    ino = entry->ino;
+  }
+  return File(*this, extents, size, get_size_compressed(ino), (get_flags(ino) & PFS_INODE_COMPRESSED) != 0);
+}
+
+uint64_t Image::calculate_size() {
+  return build_manifest().total_size;
+}
+
+uint64_t Image::get_copied() const {
+  return m_progress.get_bytes_done();
+}
+
+uint64_t Image::get_deduplicated() const {
+  return m_deduplicated;
+}
+
+progress::snapshot Image::get_progress() {
+  return m_progress.sample();
+}
+
+void Image::dump(const std::string &output_path, const extract_options &options) {
+  // Make sure output directory path exists or can be created
+  if (!std::filesystem::is_directory(output_path) && !std::filesystem::create_directories(output_path)) {
+    FATAL_ERROR("Unable to open/create output directory");
+  }
+
+  if (!options.index_path.empty() && !load_index(options.index_path)) {
+    save_index(options.index_path);
+  }
+  const manifest &listing = build_manifest(PathFilter(options.include_paths, options.exclude_paths));
+  m_progress.start(listing.total_size, listing.file_count);
+  m_deduplicated = 0;
+  if (!options.journal_path.empty()) {
+    m_journal.open(options.journal_path, m_header, options.resume);
+  }
+
+  std::vector<extract_job> jobs;
+  jobs.reserve(listing.file_count);
+  for (size_t i = 0; i < listing.entries.size(); i++) {
+    if (listing.entries[i].type != 3) {
+      jobs.push_back({i, 0});
+    }
+  }
+
+  // Directories are all made before any copy starts, so file order is free to follow the layout of the image instead of the tree
+  if (options.physical_order) {
+    std::stable_sort(jobs.begin(), jobs.end(), [&](const extract_job &a, const extract_job &b) { return listing.entries[a.entry].first_block < listing.entries[b.entry].first_block; });
+  }
+
+  // Decided up front so a duplicate never races the copy it links to
+  std::vector<link_job> links;
+  if (options.link_duplicates || options.hash_duplicates) {
+    std::vector<unsigned char> buffer(PFS_DUMP_BUFFER);
+    find_duplicates(jobs, links, options, buffer);
+  }
+
+  if (options.check_free_space) {
+    uint64_t block_size = 0;
+    uint64_t available = io::get_free_space(output_path, &block_size);
+    block_size = std::max<uint64_t>(block_size, 1);
+
+    // Every copied file takes whole filesystem blocks, links take none and files a resumed journal lists are already on disk
+    uint64_t needed = 0;
+    for (auto &&job : jobs) {
+      const manifest_entry &entry = listing.entries[job.entry];
+      const journal_record *record = m_journal.find(get_path(entry));
+      if (entry.type == 2 && (record == nullptr || record->size != entry.size)) {
+        needed += (entry.size + block_size - 1) / block_size * block_size;
+      }
+    }
+    if (needed > available) {
+      std::stringstream ss;
+      ss << "Not enough free space on the output device! Needed: " << needed << " | Available: " << available;
+      FATAL_ERROR(ss.str());
+    }
+  }
+
+  // The whole tree is made up front, every file is then opened relative to its parent's descriptor
+  io::DirectoryTree output;
+  if (!output.open(output_path)) {
+    FATAL_ERROR("Unable to open/create output directory");
+  }
+  for (auto &&entry : listing.entries) {
+    if (entry.type == 3 && !output.create(get_path(entry))) {
+      FATAL_ERROR("Could not create output directory");
+    }
+  }
+
+  m_batches.clear();
+  if (options.small_file_size > 0) {
+    batch_small_files(jobs, options);
+  }
+
+  // Workers only bump counters, sampling and the callback stay on a separate thread so they never slow the copy down
+  std::mutex report_lock;
+  std::condition_variable report_changed;
+  bool finished = false;
+  std::exception_ptr report_error;
+  std::thread reporter;
+  if (options.on_progress) {
+    reporter = std::thread([&]() {
+      std::unique_lock<std::mutex> guard(report_lock);
+      while (!report_changed.wait_for(guard, std::chrono::milliseconds(options.progress_interval), [&]() { return finished; })) {
+        guard.unlock();
+        try {
+          options.on_progress(m_progress.sample());
+        } catch (...) {
+          report_error = std::current_exception();
+          return;
+        }
+        guard.lock();
+      }
+    });
+  }
+
+  auto stop_reporter = [&]() {
+    if (reporter.joinable()) {
+      {
+        std::lock_guard<std::mutex> guard(report_lock);
+        finished = true;
+      }
+      report_changed.notify_all();
+      reporter.join();
+    }
+  };
+
+  try {
+    if (options.worker_count == 1) {
+      std::vector<unsigned char> buffer(PFS_DUMP_BUFFER);
+      std::vector<unsigned char> arena;
+      io::Pipeline pipeline;
+      for (auto &&job : jobs) {
+        run_job(output, job, options, buffer, arena, pipeline);
+      }
+    } else {
+      run_jobs(output, jobs, options);
+    }
+
+    std::vector<unsigned char> buffer(PFS_DUMP_BUFFER);
+    io::Pipeline pipeline;
+    for (auto &&link : links) {
+      link_file(output, listing.entries[link.entry], listing.entries[link.source], options, buffer, pipeline);
+    }
+  } catch (...) {
+    stop_reporter();
+
+    // Files finished before the failure still get their records, a resume then only redoes the rest
+    try {
+      flush_journal(output);
+    } catch (...) {
+    }
+    m_journal.close();
+    throw;
+  }
+  stop_reporter();
+  flush_journal(output);
+  m_journal.close();
+
+  if (report_error) {
+    std::rethrow_exception(report_error);
+  }
+  if (options.on_progress) {
+    options.on_progress(m_progress.sample());
+  }
+}
+
+void Image::parse_directory(uint32_t ino, uint32_t level, const std::string &path, const PathFilter &filter) {
+  uint64_t directory_size = get_size(ino);
+  uint64_t consumed = 0;
+
+  for (auto &&run : get_extents(ino)) {
+    for (uint64_t i = 0; i < run.count && consumed < directory_size; i++) {
+      // Entries never cross a block boundary
+      uint64_t pos = static_cast<uint64_t>(m_header.blocksz) * (run.block + i);
+      uint64_t top = pos + std::min<uint64_t>(m_header.blocksz, directory_size - consumed);
+      consumed += m_header.blocksz;
+
+      while (pos + sizeof(dirent_t) <= top) {
+        dirent_t ent;
+        read(&ent, sizeof(ent), pos); // Flawfinder: ignore
+
+        if (ent.type == 0 || ent.entsize == 0) {
+          break;
+        }
+
+        // Superroot entries are not named in the output, "uroot" maps directly onto the image root
+        std::string new_path(path);
+        if (level > 0) {
+          std::vector<char> name(ent.namelen);
+          read(&name[0], name.size(), pos + sizeof(dirent_t)); // Flawfinder: ignore
+          if (!new_path.empty()) {
+            new_path += '/';
+          }
+          new_path.append(name.begin(), name.end());
+        }
+
+        // Pruned subtrees are never read, a directory that may hold matches is only kept if it ends up holding one
+        bool keep_empty = true;
+        if (level > 0 && !filter.is_empty()) {
+          bool included = filter.is_included(new_path);
+          if (filter.is_excluded(new_path) || (!included && (ent.type != 3 || !filter.may_contain(new_path)))) {
+            pos += ent.entsize;
+            continue;
+          }
+          keep_empty = included;
+        }
+
+        size_t entry_index = m_manifest.entries.size();
+        if ((ent.type == 2 || ent.type == 3) && level > 0) {
+          if (m_manifest.paths.size() > UINT32_MAX || m_manifest.extents.size() > UINT32_MAX) {
+            FATAL_ERROR("Manifest is too large!");
+          }
+
+          uint64_t size = get_size(ent.ino);
+          manifest_entry entry = {static_cast<uint32_t>(m_manifest.paths.size()), ent.ino, size, get_block_map(ent.ino)[0], ent.type, static_cast<uint32_t>(m_manifest.extents.size()), 0};
+          if (ent.type == 2) {
+            std::vector<extent> extents = get_extents(ent.ino);
+            m_manifest.extents.insert(m_manifest.extents.end(), extents.begin(), extents.end());
+            entry.extent_count = extents.size();
+            m_manifest.total_size += size;
+            m_manifest.file_count++;
+          }
+          m_manifest.entries.push_back(entry);
+          m_manifest.paths.append(new_path);
+          m_manifest.paths.push_back('\0');
+        }
+
+        if (ent.type == 3) {
+          parse_directory(ent.ino, level + 1, new_path, filter);
+
+          if (level > 0 && !keep_empty && m_manifest.entries.size() == entry_index + 1) {
+            m_manifest.paths.resize(m_manifest.entries.back().path_offset);
+            m_manifest.entries.pop_back();
+          }
+        }
+
+        pos += ent.entsize;
+      }
+    }
+  }
+}
+
+std::string Image::hash_file(const manifest_entry &entry, std::vector<unsigned char> &buffer) const {
+  // Compressed files are compared by their stored PFSC stream, equal streams always decompress to equal data
+  bool compressed = (get_flags(entry.ino) & PFS_INODE_COMPRESSED) != 0;
+  uint64_t stored_size = compressed ? get_size_compressed(entry.ino) : entry.size;
+
+  SHA256 sha256;
+  for (uint64_t done = 0; done < stored_size;) {
+    size_t chunk = static_cast<size_t>(std::min<uint64_t>(stored_size - done, buffer.size()));
+    read_file(entry, &buffer[0], chunk, done); // Flawfinder: ignore
+    sha256.add(&buffer[0], chunk);
+    done += chunk;
+  }
+
+  std::string key(SHA256::HashBytes, '\0');
+  sha256.getHash(reinterpret_cast<unsigned char *>(&key[0]));
+  key.append(reinterpret_cast<const char *>(&entry.size), sizeof(entry.size));
+  key.push_back(compressed ? 1 : 0);
+  return key;
+}
+
+void Image::find_duplicates(std::vector<extract_job> &jobs, std::vector<link_job> &links, const extract_options &options, std::vector<unsigned char> &buffer) const {
+  // The first entry of each inode in job order is copied, later ones link to it
+  std::unordered_map<uint32_t, size_t> first_of_inode;
+  std::vector<extract_job> unique;
+  unique.reserve(jobs.size());
+  for (auto &&job : jobs) {
+    const manifest_entry &entry = m_manifest.entries[job.entry];
+    if (entry.size == 0) {
+      unique.push_back(job);
+      continue;
+    }
+
+    auto first = first_of_inode.find(entry.ino);
+    if (options.link_duplicates && first != first_of_inode.end()) {
+      links.push_back({job.entry, first->second});
+    } else {
+      first_of_inode.emplace(entry.ino, job.entry);
+      unique.push_back(job);
+    }
+  }
+
+  if (options.hash_duplicates) {
+    // Only files that share their size with another file can be identical, everything else is never read here
+    std::unordered_map<uint64_t, uint32_t> size_count;
+    for (auto &&job : unique) {
+      size_count[m_manifest.entries[job.entry].size]++;
+    }
+
+    std::unordered_map<std::string, size_t> first_of_hash;
+    std::vector<extract_job> remaining;
+    remaining.reserve(unique.size());
+    for (auto &&job : unique) {
+      const manifest_entry &entry = m_manifest.entries[job.entry];
+      if (entry.size == 0 || size_count[entry.size] < 2) {
+        remaining.push_back(job);
+        continue;
+      }
+
+      auto first = first_of_hash.emplace(hash_file(entry, buffer), job.entry);
+      if (first.second) {
+        remaining.push_back(job);
+      } else {
+        links.push_back({job.entry, first.first->second});
+      }
+    }
+    unique.swap(remaining);
+  }
+
+  jobs.swap(unique);
+}
+
+// A record is only written once the file is flushed or its CRC is stored, a file merely at the right size (ex. preallocated) is never trusted
+bool Image::is_complete(io::DirectoryTree &output, const manifest_entry &entry, std::vector<unsigned char> &buffer) const {
+  const journal_record *record = m_journal.find(get_path(entry));
+  if (record == nullptr || record->size != entry.size) {
+    return false;
+  }
+
+  int fd = output.open_file(get_path(entry), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool complete = false;
+  try {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && static_cast<uint64_t>(st.st_size) == entry.size) {
+      complete = true;
+      if ((record->flags & PFS_JOURNAL_CRC) != 0) {
+        unsigned char crc[CRC32::HashBytes];
+        file_crc(fd, entry.size, buffer, crc);
+        complete = std::memcmp(crc, record->crc, sizeof(crc)) == 0;
+      }
+    }
+  } catch (...) {
+    complete = false;
+  }
+  close(fd);
+  return complete;
+}
+
+void Image::copy_file(io::DirectoryTree &output, const manifest_entry &entry, const extract_options &options, std::vector<unsigned char> &buffer, io::Pipeline &pipeline, const unsigned char *data) {
+  unsigned char crc[CRC32::HashBytes];
+
+  m_progress.set_current(get_path(entry));
+
+  if (m_journal.is_open() && is_complete(output, entry, buffer)) {
+    m_progress.add_bytes(entry.size);
+    m_progress.finish_file();
+    return;
+  }
+
+  // Open path, readable as well when the CRC is read back for the journal
+  int output_fd = output.open_file(get_path(entry), (options.journal_crc ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC);
+  if (output_fd < 0) {
+    FATAL_ERROR("Cannot open file: " + output.get_root() + "/" + get_path(entry));
+  }
+
+  try {
+    // Best effort, filesystems that cannot preallocate are written to normally
+    if (options.preallocate && !options.sparse) {
+      io::preallocate(output_fd, entry.size);
+    }
+
+    if (data != nullptr) {
+      // Batched small file, already read along with its neighbours
+      if (options.sparse) {
+        io::pwrite_sparse(output_fd, data, entry.size, 0);
+        if (ftruncate(output_fd, entry.size) != 0) {
+          FATAL_ERROR("Error setting file size: " + std::string(get_path(entry)));
+        }
+      } else {
+        io::pwrite_all(output_fd, data, entry.size, 0);
+      }
+      m_progress.add_bytes(entry.size);
+    } else if ((get_flags(entry.ino) & PFS_INODE_COMPRESSED) != 0) {
+      decompress_file(output_fd, entry, options);
+    } else {
+      copy_extents(output_fd, entry, options, buffer, pipeline);
+    }
+
+    if (m_journal.is_open() && options.journal_crc && data != nullptr) {
+      CRC32 crc32;
+      crc32.add(data, entry.size);
+      crc32.getHash(crc);
+    } else if (m_journal.is_open() && options.journal_crc) {
+      file_crc(output_fd, entry.size, buffer, crc);
+    }
+  } catch (...) {
+    close(output_fd);
+    throw;
+  }
+
+  if (close(output_fd) != 0) {
+    FATAL_ERROR("Error closing file: " + output.get_root() + "/" + get_path(entry));
+  }
+
+  // Only logged once the file is whole, an interrupted file has no record and is copied again
+  if (m_journal.is_open()) {
+    journal_file(output, entry, options, options.journal_crc ? crc : nullptr);
+  }
+  m_progress.finish_file();
+}
+
+// A CRC is checked again on resume so its record can go out straight away, any other file has to reach the disk first
+// Those wait in the journal and a whole batch is made durable at once instead of flushing every file on its own
+void Image::journal_file(io::DirectoryTree &output, const manifest_entry &entry, const extract_options &options, const unsigned char *crc) {
+  if (options.journal_crc) {
+    m_journal.append(get_path(entry), entry.size, crc);
+  } else if (m_journal.defer(get_path(entry), entry.size) >= PFS_JOURNAL_BATCH) {
+    flush_journal(output);
+  }
+}
+
+void Image::flush_journal(io::DirectoryTree &output) {
+  m_journal.commit([&](const std::vector<std::string> &paths) {
+    if (io::sync_filesystem(output.get_root())) {
+      return;
+    }
+
+    // No filesystem wide sync on this platform, the files are still flushed together right before their records
+    for (auto &&path : paths) {
+      int fd = output.open_file(path, O_RDONLY);
+      if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0) {
+          close(fd);
+        }
+        FATAL_ERROR("Error flushing file: " + output.get_root() + "/" + path);
+      }
+      close(fd);
+    }
+  });
+}
+
+void Image::batch_small_files(std::vector<extract_job> &jobs, const extract_options &options) {
+  auto offset_of = [&](size_t index) {
+    const manifest_entry &entry = m_manifest.entries[index];
+    return static_cast<uint64_t>(m_header.blocksz) * m_manifest.extents[entry.extent_index].block;
+  };
+
+  // Only contiguous, uncompressed files can be cut straight out of a larger read
+  for (auto &&job : jobs) {
+    const manifest_entry &entry = m_manifest.entries[job.entry];
+    if (entry.size > 0 && entry.size <= options.small_file_size && entry.extent_count == 1 && (get_flags(entry.ino) & PFS_INODE_COMPRESSED) == 0) {
+      m_batches.push_back(job.entry);
+    }
+  }
+  std::stable_sort(m_batches.begin(), m_batches.end(), [&](size_t a, size_t b) { return offset_of(a) < offset_of(b); });
+
+  // Cut the physically sorted list into runs whose combined read stays within `batch_size`
+  std::unordered_map<size_t, extract_job> batch_of;
+  size_t start = 0;
+  while (start < m_batches.size()) {
+    uint64_t batch_start = offset_of(m_batches[start]);
+    uint64_t batch_end = batch_start + m_manifest.entries[m_batches[start]].size;
+    size_t end = start + 1;
+    while (end < m_batches.size()) {
+      uint64_t offset = offset_of(m_batches[end]);
+      uint64_t file_end = std::max(batch_end, offset + m_manifest.entries[m_batches[end]].size);
+      if (offset > batch_end + PFS_BATCH_MAX_GAP || file_end - batch_start > options.batch_size) {
+        break;
+      }
+      batch_end = file_end;
+      end++;
+    }
+
+    if (end - start > 1) {
+      for (size_t i = start; i < end; i++) {
+        batch_of[m_batches[i]] = {start, static_cast<uint32_t>(end - start)};
+      }
+    }
+    start = end;
+  }
+
+  // Each batch takes the place of the first of its files in the job list, the rest of its files are dropped from it
+  std::vector<extract_job> batched;
+  batched.reserve(jobs.size());
+  for (auto &&job : jobs) {
+    auto batch = batch_of.find(job.entry);
+    if (batch == batch_of.end()) {
+      batched.push_back(job);
+    } else if (batch->second.batch_count != 0) {
+      extract_job batch_job = batch->second;
+      batched.push_back(batch_job);
+      for (size_t i = 0; i < batch_job.batch_count; i++) {
+        batch_of[m_batches[batch_job.entry + i]].batch_count = 0;
+      }
+    }
+  }
+  jobs.swap(batched);
+}
+
+void Image::run_job(io::DirectoryTree &output, const extract_job &job, const extract_options &options, std::vector<unsigned char> &buffer, std::vector<unsigned char> &arena, io::Pipeline &pipeline) {
+  if (job.batch_count == 0) {
+    copy_file(output, m_manifest.entries[job.entry], options, buffer, pipeline);
+  } else {
+    copy_batch(output, job, options, buffer, arena, pipeline);
+  }
+}
+
+void Image::copy_batch(io::DirectoryTree &output, const extract_job &job, const extract_options &options, std::vector<unsigned char> &buffer, std::vector<unsigned char> &arena, io::Pipeline &pipeline) {
+  uint64_t start = UINT64_MAX;
+  uint64_t end = 0;
+  for (size_t i = 0; i < job.batch_count; i++) {
+    const manifest_entry &entry = m_manifest.entries[m_batches[job.entry + i]];
+    uint64_t offset = static_cast<uint64_t>(m_header.blocksz) * m_manifest.extents[entry.extent_index].block;
+    start = std::min(start, offset);
+    end = std::max(end, offset + entry.size);
+  }
+
+  // One read for the whole run, the arena is separate from `buffer` which copy_file still uses as scratch space
+  const unsigned char *data;
+  if (m_map.is_mapped()) {
+    data = get_mapped(start, end - start);
+  } else {
+    if (arena.size() < end - start) {
+      arena.resize(end - start);
+    }
+    read(&arena[0], end - start, start); // Flawfinder: ignore
+    data = &arena[0];
+  }
+
+  for (size_t i = 0; i < job.batch_count; i++) {
+    const manifest_entry &entry = m_manifest.entries[m_batches[job.entry + i]];
+    uint64_t offset = static_cast<uint64_t>(m_header.blocksz) * m_manifest.extents[entry.extent_index].block;
+    copy_file(output, entry, options, buffer, pipeline, data + (offset - start));
+  }
+}
+
+void Image::link_file(io::DirectoryTree &output, const manifest_entry &entry, const manifest_entry &source, const extract_options &options, std::vector<unsigned char> &buffer, io::Pipeline &pipeline) {
+  std::filesystem::path file_path(output.get_root());
+  file_path /= get_path(entry);
+  std::filesystem::path source_path(output.get_root());
+  source_path /= get_path(source);
+
+  m_progress.set_current(get_path(entry));
+
+  if (m_journal.is_open() && is_complete(output, entry, buffer)) {
+    m_progress.add_bytes(entry.size);
+    m_progress.finish_file();
+    return;
+  }
+
+  // Hardlink first, then a reflink clone, and a normal copy when the output filesystem supports neither
+  bool linked = io::hardlink(source_path, file_path);
+  if (!linked) {
+    int source_fd = output.open_file(get_path(source), O_RDONLY);
+    if (source_fd >= 0) {
+      int output_fd = output.open_file(get_path(entry), O_WRONLY | O_CREAT | O_TRUNC);
+      if (output_fd >= 0) {
+        linked = io::clone(source_fd, output_fd);
+        if (close(output_fd) != 0) {
+          linked = false;
+        }
+      }
+      close(source_fd);
+    }
+  }
+  if (!linked) {
+    copy_file(output, entry, options, buffer, pipeline);
+    return;
+  }
+
+  if (m_journal.is_open()) {
+    unsigned char crc[CRC32::HashBytes];
+    if (options.journal_crc) {
+      int fd = output.open_file(get_path(entry), O_RDONLY);
+      if (fd < 0) {
+        FATAL_ERROR("Cannot open file: " + std::string(file_path));
+      }
+      try {
+        file_crc(fd, entry.size, buffer, crc);
+      } catch (...) {
+        close(fd);
+        throw;
+      }
+      close(fd);
+    }
+    journal_file(output, entry, options, options.journal_crc ? crc : nullptr); // Same rule as copy_file, a clone is only listed once flushed
+  }
+  m_deduplicated += entry.size;
+  m_progress.add_bytes(entry.size);
+  m_progress.finish_file();
+}
+
+void Image::copy_extents(int output_fd, const manifest_entry &entry, const extract_options &options, std::vector<unsigned char> &buffer, io::Pipeline &pipeline) {
+  // Block runs as ranges of the image, the last one cut at the file size
+  std::vector<io::copy_range> ranges;
+  uint64_t written = 0;
+  for (uint32_t i = 0; i < entry.extent_count && written < entry.size; i++) {
+    const extent &run = m_manifest.extents[entry.extent_index + i];
+    uint64_t offset = static_cast<uint64_t>(m_header.blocksz) * run.block;
+    uint64_t length = std::min<uint64_t>(static_cast<uint64_t>(m_header.blocksz) * run.count, entry.size - written);
+    if (offset > m_size || length > m_size - offset) {
+      FATAL_ERROR("Error reading image data!");
+    }
+    ranges.push_back({offset, written, length});
+    written += length;
   }
-  if (__builtin_bswap64(header.magic) != PFS_MAGIC) {
-    pfs_input.close();
-    std::stringstream ss;
-    ss << "File magic does not match pfs_image.dat! Expected: 0x" << std::uppercase << std::setfill('0') << std::setw(16) << std::hex << PFS_MAGIC << " | Actual: 0x" << std::uppercase << std::setfill('0') << std::setw(16) << std::hex << __builtin_bswap64(header.magic);
-    FATAL_ERROR(ss.str());
+  if (written < entry.size) {
+    FATAL_ERROR("Block map is shorter than the file size: " + std::string(get_path(entry)));
   }
 
-  // Read in inodes
-  for (uint64_t i = 0; i < header.ndinodeblock; i++) {
-    for (uint64_t j = 0; (j < (header.blocksz / sizeof(di_d32))) && (j < header.ndinode); j++) {
-      di_d32 temp_inodes;
-      pfs_input.seekg(static_cast<uint64_t>(header.blocksz) * (i + 1) + sizeof(di_d32) * j, pfs_input.beg);
-      pfs_input.read(reinterpret_cast<char *>(&temp_inodes), sizeof(di_d32)); // Flawfinder: ignore
-      if (!pfs_input.good()) {
-        pfs_input.close();
-        FATAL_ERROR("Error reading inodes!");
+  if (!options.sparse && !m_map.is_mapped() && options.copy_method == io::CopyMethod::Pipeline) {
+    // The whole file streams through the worker's ring in one pass, progress moves as each buffer is written out
+    for (auto &&range : ranges) {
+      range.input_offset += m_offset;
+    }
+    pipeline.copy(m_fd, output_fd, ranges, [&](uint64_t bytes) { m_progress.add_bytes(bytes); });
+    return;
+  }
+
+  // Otherwise one large copy per extent, split into PFS_PROGRESS_CHUNK pieces so progress keeps moving on big files
+  for (auto &&range : ranges) {
+    for (uint64_t done = 0; done < range.size;) {
+      uint64_t offset = range.input_offset + done;
+      uint64_t length = std::min<uint64_t>(PFS_PROGRESS_CHUNK, range.size - done);
+      if (options.sparse) {
+        // Zero detection needs the data in memory, the mapping already is, otherwise go through the buffer
+        const unsigned char *data;
+        if (m_map.is_mapped()) {
+          data = get_mapped(offset, length);
+        } else {
+          if (buffer.empty()) {
+            buffer.resize(PFS_DUMP_BUFFER);
+          }
+          length = std::min<uint64_t>(length, buffer.size());
+          read(&buffer[0], length, offset); // Flawfinder: ignore
+          data = &buffer[0];
+        }
+        io::pwrite_sparse(output_fd, data, length, range.output_offset + done);
+      } else if (m_map.is_mapped() && options.copy_method == io::CopyMethod::ReadWrite) {
+        // Write straight out of the mapping, there is nothing to read into a buffer first
+        io::pwrite_all(output_fd, get_mapped(offset, length), length, range.output_offset + done);
+      } else {
+        io::copy(m_fd, m_offset + offset, output_fd, range.output_offset + done, length, options.copy_method, buffer, &pipeline);
       }
-      inodes.push_back(temp_inodes);
+      m_progress.add_bytes(length);
+      done += length;
+    }
+  }
+
+  // Skipped zeros at the end of the file never extended it
+  if (options.sparse && ftruncate(output_fd, entry.size) != 0) {
+    FATAL_ERROR("Error setting file size: " + std::string(get_path(entry)));
+  }
+}
+
+void Image::decompress_file(int output_fd, const manifest_entry &entry, const extract_options &options) {
+  pfsc::reader reader = [&](void *buffer, size_t size, uint64_t offset) { read_file(entry, buffer, size, offset); }; // Flawfinder: ignore
+  if (!pfsc::is_pfsc(reader)) {
+    FATAL_ERROR("Compressed inode does not contain PFSC data: " + std::string(get_path(entry)));
+  }
+
+  // Progress counts the inode size, never more or less than that per file
+  uint64_t reported = 0;
+  pfsc::written_callback on_written = [&](uint64_t bytes) {
+    bytes = std::min(bytes, entry.size - reported);
+    m_progress.add_bytes(bytes);
+    reported += bytes;
+  };
+  pfsc::decompress(reader, get_size_compressed(entry.ino), output_fd, options.decompress_workers, options.max_inflight_blocks, on_written, options.sparse);
+
+  // The inode size is authoritative
+  if (ftruncate(output_fd, entry.size) != 0) {
+    FATAL_ERROR("Error setting file size: " + std::string(get_path(entry)));
+  }
+  m_progress.add_bytes(entry.size - reported);
+}
+
+void Image::run_jobs(io::DirectoryTree &output, std::vector<extract_job> &jobs, const extract_options &options) {
+  uint32_t worker_count = options.worker_count;
+  if (worker_count == 0) {
+    worker_count = std::max(1U, std::thread::hardware_concurrency());
+  }
+
+  // Every worker may be inflating a compressed file at once, so the inflate threads and blocks in flight are budgets for the whole image split between them
+  extract_options job_options = options;
+  uint32_t inflate_workers = options.decompress_workers != 0 ? options.decompress_workers : std::max(1U, std::thread::hardware_concurrency());
+  job_options.decompress_workers = std::max(1U, inflate_workers / worker_count);
+  job_options.max_inflight_blocks = std::max(1U, options.max_inflight_blocks / worker_count);
+
+  // Seed each worker with a contiguous slice so neighbouring files stay on the same worker until stolen
+  std::vector<job_queue> queues(worker_count);
+  for (uint32_t i = 0; i < worker_count; i++) {
+    size_t start = jobs.size() * i / worker_count;
+    size_t end = jobs.size() * (i + 1) / worker_count;
+    for (size_t j = start; j < end; j++) {
+      queues[i].jobs.push_back(jobs[j]);
     }
   }
+  jobs.clear();
+
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_lock;
+
+  auto worker = [&](uint32_t id) {
+    std::vector<unsigned char> buffer(PFS_DUMP_BUFFER);
+    std::vector<unsigned char> arena;
+    io::Pipeline pipeline;
+    while (!failed) {
+      extract_job job;
+      bool found = false;
+
+      // Own queue first, walking the slice front to back so reads stay in order
+      {
+        std::lock_guard<std::mutex> guard(queues[id].lock);
+        if (!queues[id].jobs.empty()) {
+          job = queues[id].jobs.front();
+          queues[id].jobs.pop_front();
+          found = true;
+        }
+      }
+
+      // Steal from the back of another worker's queue, as far as possible from where its owner is reading
+      // Only whole jobs move, a file is always copied front to back by the one worker that took it, but with physical_order
+      // set a stolen job is read out of turn, so the image as a whole is only close to sequential while no worker runs dry
+      for (uint32_t i = 1; !found && i < worker_count; i++) {
+        job_queue &victim = queues[(id + i) % worker_count];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+          job = victim.jobs.back();
+          victim.jobs.pop_back();
+          found = true;
+        }
+      }
+
+      // Traversal is finished before workers start so empty queues mean there is nothing left
+      if (!found) {
+        break;
+      }
 
-  pfs_size = 0;
-  pfs_copied = 0;
+      try {
+        run_job(output, job, job_options, buffer, arena, pipeline);
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(error_lock);
+        if (!failed) {
+          error = std::current_exception();
+          failed = true;
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < worker_count; i++) {
+    workers.emplace_back(worker, i);
+  }
+  for (auto &&thread : workers) {
+    thread.join();
+  }
 
-  calculate_pfs_size(header.superroot_ino, 0);
-  dump_pfs(header.superroot_ino, 0, output_path);
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
 
-  pfs_input.close();
+void extract(const std::string &pfs_path, const std::string &output_path, const extract_options &options) {
+  Image image(pfs_path, options.memory_map);
+  image.dump(output_path, options);
 }
 } // namespace pfs
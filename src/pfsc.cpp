@@ -0,0 +1,250 @@
+// Copyright (c) 2021-2022 Al Azif
+// License: GPLv3
+
+#include "pfsc.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "io.h"
+
+namespace pfsc {
+bool is_pfsc(const reader &read) { // Flawfinder: ignore
+  uint32_t magic = 0;
+  read(&magic, sizeof(magic), 0); // Flawfinder: ignore
+  return magic == PFSC_MAGIC;
+}
+
+void inflate_block(const std::vector<unsigned char> &input, std::vector<unsigned char> &output, size_t output_size) {
+  output.resize(output_size);
+
+  // Blocks are normally zlib wrapped, fall back to a raw deflate stream when there is no valid zlib header
+  bool zlib_header = input.size() >= 2 && (input[0] & 0x0F) == Z_DEFLATED && ((input[0] << 8) | input[1]) % 31 == 0;
+
+  z_stream stream = {};
+  if (inflateInit2(&stream, zlib_header ? MAX_WBITS : -MAX_WBITS) != Z_OK) {
+    FATAL_ERROR("Unable to initialize zlib!");
+  }
+
+  stream.next_in = const_cast<Bytef *>(input.data());
+  stream.avail_in = input.size();
+  stream.next_out = output.data();
+  stream.avail_out = output.size();
+
+  int ret = inflate(&stream, Z_FINISH);
+  uLong total_out = stream.total_out;
+  inflateEnd(&stream);
+
+  if (ret != Z_STREAM_END || total_out != output_size) {
+    FATAL_ERROR("Error decompressing PFSC block!");
+  }
+}
+
+static void read_block_table(const reader &read, uint64_t stream_size, PfscHeader &header, std::vector<uint64_t> &offsets) { // Flawfinder: ignore
+  if (stream_size < sizeof(header)) {
+    FATAL_ERROR("Input is not PFSC compressed!");
+  }
+  read(&header, sizeof(header), 0); // Flawfinder: ignore
+  if (header.magic != PFSC_MAGIC) {
+    FATAL_ERROR("Input is not PFSC compressed!");
+  }
+  if (header.block_size == 0 || header.block_size > PFSC_MAX_BLOCK_SIZE) {
+    FATAL_ERROR("Invalid PFSC block size!");
+  }
+
+  // The table has to fit in the stream before anything is allocated for it, a corrupt header cannot ask for more than that
+  uint64_t block_count = header.data_length / header.block_size + (header.data_length % header.block_size != 0 ? 1 : 0);
+  if (header.block_offsets > stream_size || block_count >= (stream_size - header.block_offsets) / sizeof(uint64_t)) {
+    FATAL_ERROR("Corrupt PFSC block table!");
+  }
+  offsets.resize(block_count + 1);
+  read(&offsets[0], offsets.size() * sizeof(uint64_t), header.block_offsets); // Flawfinder: ignore
+}
+
+static void decode_block(const reader &read, const PfscHeader &header, const std::vector<uint64_t> &offsets, uint64_t index, std::vector<unsigned char> &compressed, std::vector<unsigned char> &output) { // Flawfinder: ignore
+  if (offsets[index + 1] < offsets[index]) {
+    FATAL_ERROR("Corrupt PFSC block table!");
+  }
+  uint64_t compressed_size = offsets[index + 1] - offsets[index];
+  size_t output_size = std::min<uint64_t>(header.block_size, header.data_length - index * header.block_size);
+
+  // A block stored at full size is uncompressed, an oversized or empty block is all zeros
+  if (compressed_size == header.block_size) {
+    output.resize(output_size);
+    read(&output[0], output_size, offsets[index]); // Flawfinder: ignore
+  } else if (compressed_size == 0 || compressed_size > header.block_size) {
+    output.assign(output_size, 0);
+  } else {
+    compressed.resize(compressed_size);
+    read(&compressed[0], compressed.size(), offsets[index]); // Flawfinder: ignore
+    inflate_block(compressed, output, output_size);
+  }
+}
+
+Stream::Stream(const reader &read, uint64_t stream_size) : m_read(read), m_cached_block(UINT64_MAX) { // Flawfinder: ignore
+  read_block_table(m_read, stream_size, m_header, m_offsets);
+}
+
+uint64_t Stream::get_size() const {
+  return m_header.data_length;
+}
+
+void Stream::read(void *buffer, size_t size, uint64_t offset) { // Flawfinder: ignore
+  if (offset > m_header.data_length || size > m_header.data_length - offset) {
+    FATAL_ERROR("Read past the end of the PFSC stream!");
+  }
+
+  // Sequential small reads hit the same block over and over, so the last decoded block is kept
+  unsigned char *output = static_cast<unsigned char *>(buffer);
+  while (size > 0) {
+    uint64_t index = offset / m_header.block_size;
+    if (index != m_cached_block) {
+      m_cached_block = UINT64_MAX;
+      decode_block(m_read, m_header, m_offsets, index, m_compressed, m_block);
+      m_cached_block = index;
+    }
+
+    uint64_t within = offset - index * m_header.block_size;
+    size_t length = std::min<uint64_t>(size, m_block.size() - within);
+    std::memcpy(output, &m_block[within], length);
+    output += length;
+    offset += length;
+    size -= length;
+  }
+}
+
+void decompress(const reader &read, uint64_t stream_size, int output_fd, uint32_t worker_count, uint32_t max_inflight_blocks, const written_callback &on_written, bool sparse) { // Flawfinder: ignore
+  PfscHeader header;
+  std::vector<uint64_t> offsets;
+  read_block_table(read, stream_size, header, offsets);
+  uint64_t block_count = offsets.size() - 1;
+
+  auto decode = [&](uint64_t index, std::vector<unsigned char> &compressed, std::vector<unsigned char> &output) { decode_block(read, header, offsets, index, compressed, output); };
+  auto write = [&](const std::vector<unsigned char> &block, uint64_t index) {
+    if (sparse) {
+      io::pwrite_sparse(output_fd, block.data(), block.size(), index * header.block_size);
+    } else {
+      io::pwrite_all(output_fd, block.data(), block.size(), index * header.block_size);
+    }
+  };
+
+  if (worker_count == 0) {
+    worker_count = std::max(1U, std::thread::hardware_concurrency());
+  }
+  max_inflight_blocks = std::max(1U, max_inflight_blocks);
+  worker_count = std::min(worker_count, max_inflight_blocks);
+
+  if (worker_count == 1) {
+    std::vector<unsigned char> compressed;
+    std::vector<unsigned char> output;
+    for (uint64_t i = 0; i < block_count; i++) {
+      decode(i, compressed, output);
+      write(output, i);
+      if (on_written) {
+        on_written(output.size());
+      }
+    }
+    return;
+  }
+
+  // Workers claim blocks in order but never get more than `max_inflight_blocks` ahead of the writer, bounding memory use
+  std::mutex lock;
+  std::condition_variable changed;
+  uint64_t next_block = 0;
+  uint64_t written = 0;
+  std::map<uint64_t, std::vector<unsigned char>> decoded;
+  bool failed = false;
+  std::exception_ptr error;
+
+  auto fail = [&](std::exception_ptr current) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!failed) {
+      error = current;
+      failed = true;
+    }
+    changed.notify_all();
+  };
+
+  auto worker = [&]() {
+    std::vector<unsigned char> compressed;
+    while (true) {
+      uint64_t index;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return failed || next_block >= block_count || next_block < written + max_inflight_blocks; });
+        if (failed || next_block >= block_count) {
+          return;
+        }
+        index = next_block++;
+      }
+
+      std::vector<unsigned char> output;
+      try {
+        decode(index, compressed, output);
+      } catch (...) {
+        fail(std::current_exception());
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        decoded[index] = std::move(output);
+      }
+      changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < worker_count; i++) {
+    workers.emplace_back(worker);
+  }
+
+  // Blocks are written strictly in order on this thread
+  while (true) {
+    std::vector<unsigned char> block;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [&]() { return failed || written >= block_count || decoded.count(written) != 0; });
+      if (failed || written >= block_count) {
+        break;
+      }
+      block = std::move(decoded[written]);
+      decoded.erase(written);
+    }
+
+    try {
+      write(block, written);
+      if (on_written) {
+        on_written(block.size());
+      }
+    } catch (...) {
+      fail(std::current_exception());
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      written++;
+    }
+    changed.notify_all();
+  }
+
+  for (auto &&thread : workers) {
+    thread.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+} // namespace pfsc
@@ -3,17 +3,168 @@
 
 #include "pkg.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <exception>
 #include <filesystem>
-#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <sha256.h>
+
 #include "common.h"
+#include "io.h"
+#include "pfs.h"
 
 namespace pkg {
+Package::Package(const std::string &pkg_path, bool memory_map) : m_size(0) {
+  // Check for empty or pure whitespace path
+  if (pkg_path.empty() || std::all_of(pkg_path.begin(), pkg_path.end(), [](char c) { return std::isspace(c); })) {
+    FATAL_ERROR("Empty input path argument!");
+  }
+
+  // Check if file exists and is file
+  if (!std::filesystem::is_regular_file(pkg_path)) {
+    FATAL_ERROR("Input path does not exist or is not a file!");
+  }
+
+  // Open path
+  m_fd.reset(open(pkg_path.c_str(), O_RDONLY)); // Flawfinder: ignore
+  if (!m_fd.is_open()) {
+    FATAL_ERROR("Cannot open input file: " + std::string(pkg_path));
+  }
+
+  struct stat st;
+  if (fstat(m_fd.get(), &st) != 0) {
+    FATAL_ERROR("Unable to stat input file!");
+  }
+  m_size = st.st_size;
+
+  if (memory_map) {
+    m_map.map(m_fd.get());
+  }
+
+  // Check file magic (Read in whole header)
+  if (m_size < sizeof(m_header)) {
+    FATAL_ERROR("Error reading PKG header!");
+  }
+  io::pread_all(m_fd.get(), &m_header, sizeof(m_header), 0);
+  if (__builtin_bswap32(m_header.magic) != PKG_MAGIC) {
+    FATAL_ERROR("Input path is not a PKG!");
+  }
+
+  // Only the table itself is read, entry data stays on disk until asked for
+  uint64_t table_offset = __builtin_bswap32(m_header.entry_table_offset);
+  uint64_t entry_count = __builtin_bswap32(m_header.entry_count);
+  if (table_offset > m_size || entry_count > (m_size - table_offset) / sizeof(PkgTableEntry)) {
+    FATAL_ERROR("Error reading entry table!");
+  }
+  m_entries.resize(entry_count);
+  if (entry_count > 0) {
+    io::pread_all(m_fd.get(), &m_entries[0], entry_count * sizeof(PkgTableEntry), table_offset);
+  }
+
+  // First entry wins if an id is ever listed twice
+  for (size_t i = 0; i < m_entries.size(); i++) {
+    uint32_t id = __builtin_bswap32(m_entries[i].id);
+    m_id_index.emplace(id, i);
+    std::string name = get_entry_name_by_type(id);
+    if (!name.empty()) {
+      m_name_index.emplace(name, i);
+    }
+  }
+}
+
+const PkgHeader &Package::get_header() const {
+  return m_header;
+}
+
+Span<const PkgTableEntry> Package::get_entries() const {
+  return Span<const PkgTableEntry>(m_entries.data(), m_entries.size());
+}
+
+const PkgTableEntry *Package::find(uint32_t id) const {
+  auto found = m_id_index.find(id);
+  if (found == m_id_index.end()) {
+    return nullptr;
+  }
+  return &m_entries[found->second];
+}
+
+const PkgTableEntry *Package::find(const std::string &name) const {
+  auto found = m_name_index.find(name);
+  if (found == m_name_index.end()) {
+    return nullptr;
+  }
+  return &m_entries[found->second];
+}
+
+size_t Package::read_entry(uint32_t id, void *buffer, size_t size, uint64_t offset) const { // Flawfinder: ignore
+  const PkgTableEntry &entry = get_entry(id);
+  uint64_t entry_size = __builtin_bswap32(entry.size);
+  if (offset >= entry_size) {
+    return 0;
+  }
+  size = std::min<uint64_t>(size, entry_size - offset);
+
+  uint64_t position = __builtin_bswap32(entry.offset) + offset;
+  if (m_map.is_mapped()) {
+    std::memcpy(buffer, m_map.get_data() + position, size);
+  } else {
+    io::pread_all(m_fd.get(), buffer, size, position);
+  }
+  return size;
+}
+
+std::vector<unsigned char> Package::read_entry(uint32_t id) const { // Flawfinder: ignore
+  std::vector<unsigned char> data(__builtin_bswap32(get_entry(id).size));
+  if (!data.empty()) {
+    read_entry(id, &data[0], data.size()); // Flawfinder: ignore
+  }
+  return data;
+}
+
+Span<const unsigned char> Package::get_entry_data(uint32_t id) const {
+  if (!m_map.is_mapped()) {
+    FATAL_ERROR("Package is not memory mapped!");
+  }
+  const PkgTableEntry &entry = get_entry(id);
+  return Span<const unsigned char>(m_map.get_data() + __builtin_bswap32(entry.offset), __builtin_bswap32(entry.size));
+}
+
+Span<const unsigned char> Package::get_data() const {
+  if (!m_map.is_mapped()) {
+    FATAL_ERROR("Package is not memory mapped!");
+  }
+  return Span<const unsigned char>(m_map.get_data(), m_map.get_size());
+}
+
+bool Package::is_memory_mapped() const {
+  return m_map.is_mapped();
+}
+
+const PkgTableEntry &Package::get_entry(uint32_t id) const {
+  const PkgTableEntry *entry = find(id);
+  if (entry == nullptr) {
+    FATAL_ERROR("Entry not found in PKG!");
+  }
+  if (static_cast<uint64_t>(__builtin_bswap32(entry->offset)) + __builtin_bswap32(entry->size) > m_size) {
+    FATAL_ERROR("Error reading entry data!");
+  }
+  return *entry;
+}
+
 bool is_pkg(const std::string &path) {
   // TODO
 
@@ -132,6 +283,22 @@ std::string get_entry_name_by_type(uint32_t type) {
   return ss.str();
 }
 
+bool get_entry_table(const unsigned char *pkg_data, uint64_t pkg_size, Span<const PkgTableEntry> &entries) {
+  if (pkg_size < sizeof(PkgHeader)) {
+    return false;
+  }
+  const PkgHeader *header = reinterpret_cast<const PkgHeader *>(pkg_data);
+
+  uint64_t table_offset = __builtin_bswap32(header->entry_table_offset);
+  uint64_t entry_count = __builtin_bswap32(header->entry_count);
+  if (table_offset > pkg_size || entry_count > (pkg_size - table_offset) / sizeof(PkgTableEntry)) {
+    return false;
+  }
+
+  entries = Span<const PkgTableEntry>(reinterpret_cast<const PkgTableEntry *>(pkg_data + table_offset), entry_count);
+  return true;
+}
+
 void extract_sc0(const std::string &pkg_path, const std::string &output_path) {
   // Check for empty or pure whitespace path
   if (pkg_path.empty() || std::all_of(pkg_path.begin(), pkg_path.end(), [](char c) { return std::isspace(c); })) {
@@ -144,39 +311,38 @@ void extract_sc0(const std::string &pkg_path, const std::string &output_path) {
   }
 
   // Open path
-  std::ifstream pkg_input(pkg_path, std::ios::in | std::ios::binary);
-  if (!pkg_input || !pkg_input.good()) {
-    pkg_input.close();
+  int pkg_fd = open(pkg_path.c_str(), O_RDONLY); // Flawfinder: ignore
+  if (pkg_fd < 0) {
     FATAL_ERROR("Cannot open input file: " + std::string(pkg_path));
   }
 
+  // Entries are written straight out of the mapping, nothing is copied through user buffers
+  io::MappedFile pkg_map;
+  try {
+    pkg_map.map(pkg_fd);
+  } catch (...) {
+    close(pkg_fd);
+    throw;
+  }
+  close(pkg_fd);
+
   // Check file magic (Read in whole header)
-  PkgHeader header;
-  pkg_input.read(reinterpret_cast<char *>(&header), sizeof(header)); // Flawfinder: ignore
-  if (!pkg_input.good()) {
-    pkg_input.close();
+  if (pkg_map.get_size() < sizeof(PkgHeader)) {
     FATAL_ERROR("Error reading PKG header!");
   }
-  if (__builtin_bswap32(header.magic) != PKG_MAGIC) {
-    pkg_input.close();
+  const PkgHeader *header = reinterpret_cast<const PkgHeader *>(pkg_map.get_data());
+  if (__builtin_bswap32(header->magic) != PKG_MAGIC) {
     // #include <iomanip>
     // std::stringstream ss;
-    // ss << "File magic does not match a PKG! Expected: 0x" << std::uppercase << std::setfill('0') << std::setw(8) << std::hex << PKG_MAGIC << " | Actual: 0x" << std::uppercase << std::setfill('0') << std::setw(8) << std::hex << __builtin_bswap32(header.magic);
+    // ss << "File magic does not match a PKG! Expected: 0x" << std::uppercase << std::setfill('0') << std::setw(8) << std::hex << PKG_MAGIC << " | Actual: 0x" << std::uppercase << std::setfill('0') << std::setw(8) << std::hex << __builtin_bswap32(header->magic);
     // FATAL_ERROR(ss.str());
     FATAL_ERROR("Input path is not a PKG!");
   }
 
-  // Read PKG entry table entries
-  std::vector<PkgTableEntry> entries;
-  pkg_input.seekg(__builtin_bswap32(header.entry_table_offset), pkg_input.beg);
-  for (uint32_t i = 0; i < __builtin_bswap32(header.entry_count); i++) {
-    PkgTableEntry temp_entry;
-    pkg_input.read(reinterpret_cast<char *>(&temp_entry), sizeof(temp_entry)); // Flawfinder: ignore
-    if (!pkg_input.good()) {
-      pkg_input.close();
-      FATAL_ERROR("Error reading entry table!");
-    }
-    entries.push_back(temp_entry);
+  // PKG entry table entries, viewed in place
+  Span<const PkgTableEntry> entries;
+  if (!get_entry_table(pkg_map.get_data(), pkg_map.get_size(), entries)) {
+    FATAL_ERROR("Error reading entry table!");
   }
 
   // Check for empty or pure whitespace path
@@ -185,8 +351,8 @@ void extract_sc0(const std::string &pkg_path, const std::string &output_path) {
   }
 
   // Make sure output directory path exists or can be created
-  if (!std::filesystem::is_directory(output_path) && !std::filesystem::create_directories(output_path)) {
-    pkg_input.close();
+  io::DirectoryTree output;
+  if ((!std::filesystem::is_directory(output_path) && !std::filesystem::create_directories(output_path)) || !output.open(output_path)) {
     FATAL_ERROR("Unable to open/create output directory");
   }
 
@@ -197,48 +363,169 @@ void extract_sc0(const std::string &pkg_path, const std::string &output_path) {
       bool entry_encrpyted((__builtin_bswap32(entry.flags1) & 0x80000000) != 0);
       uint32_t entry_key_index = (__builtin_bswap32(entry.flags2) & 0xF000) >> 12;
 
-      std::filesystem::path temp_output_path(output_path);
-      temp_output_path /= entry_name;
-
-      pkg_input.seekg(__builtin_bswap32(entry.offset), pkg_input.beg);
-      std::vector<unsigned char> temp_file(__builtin_bswap32(entry.size));
-      pkg_input.read(reinterpret_cast<char *>(&temp_file[0]), temp_file.size()); // Flawfinder: ignore
-      if (!pkg_input.good()) {
-        pkg_input.close();
+      uint64_t entry_offset = __builtin_bswap32(entry.offset);
+      uint64_t entry_size = __builtin_bswap32(entry.size);
+      if (entry_offset + entry_size > pkg_map.get_size()) {
         FATAL_ERROR("Error reading entry data!");
       }
 
-      std::filesystem::path temp_output_dir = temp_output_path;
-      temp_output_dir.remove_filename();
-
-      if (!std::filesystem::is_directory(temp_output_dir) && !std::filesystem::create_directories(temp_output_dir)) {
-        pkg_input.close();
+      // Subdirectories such as `trophy` are only created the first time an entry needs them
+      size_t separator = entry_name.rfind('/');
+      if (separator != std::string::npos && !output.create(entry_name.substr(0, separator))) {
         FATAL_ERROR("Unable to open/create output subdirectory");
       }
 
       if (entry_encrpyted) {
         // Only have key at index 3
         if (entry_key_index == 3) {
-          // TODO: Decrypt and save as `temp_output_path`
+          // TODO: Decrypt and save as `entry_name`
         }
-        temp_output_path += ".encrypted";
+        entry_name += ".encrypted";
       }
 
-      // Open path
-      std::ofstream output_file(temp_output_path, std::ios::out | std::ios::trunc | std::ios::binary);
-      if (!output_file || !output_file.good()) {
-        pkg_input.close();
-        output_file.close();
-        FATAL_ERROR("Cannot open file: " + std::string(temp_output_path));
+      // Open path relative to the already open parent directory
+      int output_fd = output.open_file(entry_name, O_WRONLY | O_CREAT | O_TRUNC);
+      if (output_fd < 0) {
+        FATAL_ERROR("Cannot open file: " + output.get_root() + "/" + entry_name);
       }
 
       // Write to file
-      std::stringstream ss;
-      ss.write(reinterpret_cast<const char *>(&temp_file[0]), temp_file.size());
-      output_file << ss.rdbuf();
-      output_file.close();
+      try {
+        io::pwrite_all(output_fd, pkg_map.get_data() + entry_offset, entry_size, 0);
+      } catch (...) {
+        close(output_fd);
+        throw;
+      }
+      if (close(output_fd) != 0) {
+        FATAL_ERROR("Error closing file: " + output.get_root() + "/" + entry_name);
+      }
     }
   }
-  pkg_input.close();
+}
+
+void extract_pfs(const std::string &pkg_path, const std::string &output_path, const pfs::extract_options &options) {
+  uint64_t image_offset;
+  uint64_t image_size;
+  {
+    Package package(pkg_path);
+    image_offset = __builtin_bswap64(package.get_header().pfs_image_offset);
+    image_size = __builtin_bswap64(package.get_header().pfs_image_size);
+  }
+  if (image_size == 0) {
+    FATAL_ERROR("PKG does not contain a PFS image!");
+  }
+
+  // Read in place out of the package, an encrypted image fails the PFS magic check here
+  std::unique_ptr<pfs::Image> image = std::make_unique<pfs::Image>(pkg_path, options.memory_map, image_offset, image_size);
+
+  // The outer image normally only holds the nested pfs_image.dat, when that is stored plainly in one run it is just another range of the package
+  const pfs::manifest_entry *nested = image->find("pfs_image.dat");
+  if (nested != nullptr && image->build_manifest().file_count == 1 && (image->get_flags(nested->ino) & PFS_INODE_COMPRESSED) != 0) {
+    // pfs::Image reads its image as ranges of a file, a PFSC stream would have to be inflated to disk first
+    FATAL_ERROR("Nested PFS image is PFSC compressed, it cannot be extracted in place!");
+  }
+  if (nested != nullptr && image->build_manifest().file_count == 1) {
+    std::vector<pfs::extent> extents = image->get_extents(nested->ino);
+    uint64_t block_size = image->get_header().blocksz;
+    pfs::pfs_header header;
+    header.magic = 0;
+    if (extents.size() == 1 && block_size * extents[0].count >= nested->size && nested->size >= sizeof(header)) {
+      image->read(&header, sizeof(header), block_size * extents[0].block); // Flawfinder: ignore
+    }
+    if (__builtin_bswap64(header.magic) == PFS_MAGIC) {
+      uint64_t nested_offset = image_offset + block_size * extents[0].block;
+      uint64_t nested_size = nested->size;
+      image.reset();
+      image = std::make_unique<pfs::Image>(pkg_path, options.memory_map, nested_offset, nested_size);
+    }
+  }
+
+  image->dump(output_path, options);
+}
+
+std::vector<verify_result> verify(const std::string &pkg_path) {
+  Package package(pkg_path, true);
+  const PkgHeader &header = package.get_header();
+  Span<const unsigned char> data = package.get_data();
+
+  // Digest layouts follow LibOrbisPKG. sc_entries2 is the least certain: it is taken to cover only the
+  // table rows of the sc entries, a PKG built another way may legitimately fail that one region
+  typedef struct {
+    const char *name;
+    uint64_t offset;
+    uint64_t size;
+    const unsigned char *expected;
+  } region;
+  std::vector<region> regions;
+  uint64_t table_offset = __builtin_bswap32(header.entry_table_offset);
+  regions.push_back({"sc_entries1", table_offset, __builtin_bswap32(header.main_ent_data_size), header.sc_entries1_hash});
+  regions.push_back({"sc_entries2", table_offset, static_cast<uint64_t>(__builtin_bswap16(header.sc_entry_count)) * sizeof(PkgTableEntry), header.sc_entries2_hash});
+  const PkgTableEntry *digests = package.find(0x0001);
+  if (digests != nullptr) {
+    regions.push_back({"digest_table", __builtin_bswap32(digests->offset), __builtin_bswap32(digests->size), header.digest_table_hash});
+  }
+  regions.push_back({"body", __builtin_bswap64(header.body_offset), __builtin_bswap64(header.body_size), header.body_digest});
+  regions.push_back({"pfs_image", __builtin_bswap64(header.pfs_image_offset), __builtin_bswap64(header.pfs_image_size), header.pfs_image_digest});
+  regions.push_back({"pfs_signed", __builtin_bswap64(header.pfs_image_offset), __builtin_bswap32(header.pfs_signed_size), header.pfs_signed_digest});
+
+  std::vector<verify_result> results;
+  std::vector<const unsigned char *> expected;
+  std::map<uint64_t, std::vector<size_t>> passes; // Start offset to the results hashed in the same pass
+  for (auto &&check : regions) {
+    // Packages without a PFS image (ex. some DLC) simply have nothing to check there
+    if (check.size == 0) {
+      continue;
+    }
+    verify_result result = {check.name, check.offset, check.size, false, 0.0, 0.0};
+    if (check.offset <= data.size() && check.size <= data.size() - check.offset) {
+      passes[check.offset].push_back(results.size());
+    }
+    results.push_back(result);
+    expected.push_back(check.expected);
+  }
+
+  // SHA-256 is sequential so a single digest cannot be split, instead every pass runs on its own thread over the shared mapping
+  // Digests over a common prefix (pfs_signed inside pfs_image, both sc entry hashes) come out of one pass as intermediate hashes
+  std::exception_ptr error;
+  std::mutex error_lock;
+  std::vector<std::thread> workers;
+  for (auto &&pass : passes) {
+    std::sort(pass.second.begin(), pass.second.end(), [&](size_t a, size_t b) { return results[a].size < results[b].size; });
+
+    workers.emplace_back([&, offset = pass.first, &members = pass.second]() {
+      try {
+        auto start = std::chrono::steady_clock::now();
+        SHA256 sha256;
+        uint64_t done = 0;
+        for (auto &&index : members) {
+          verify_result &result = results[index];
+          sha256.add(data.data() + offset + done, result.size - done);
+          done = result.size;
+
+          unsigned char digest[SHA256::HashBytes];
+          sha256.getHash(digest);
+          result.passed = std::memcmp(digest, expected[index], sizeof(digest)) == 0;
+          result.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        for (auto &&index : members) {
+          verify_result &result = results[index];
+          result.rate = result.elapsed > 0.0 ? result.size / result.elapsed : 0.0;
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(error_lock);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    });
+  }
+  for (auto &&thread : workers) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  return results;
 }
 } // namespace pkg
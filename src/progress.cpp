@@ -0,0 +1,98 @@
+// Copyright (c) 2021-2022 Al Azif
+// License: GPLv3
+
+#include "progress.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#define BYTES_PER_MB 1000000.0
+
+namespace progress {
+Tracker::Tracker() : m_bytes_done(0), m_files_done(0), m_bytes_total(0), m_files_total(0), m_last_bytes(0), m_average_rate(-1) {
+  m_start = std::chrono::steady_clock::now();
+  m_last_time = m_start;
+}
+
+void Tracker::start(uint64_t bytes_total, uint64_t files_total) {
+  std::lock_guard<std::mutex> guard(m_sample_lock);
+  m_bytes_done = 0;
+  m_files_done = 0;
+  {
+    std::lock_guard<std::mutex> current_guard(m_current_lock);
+    m_current.clear();
+  }
+  m_bytes_total = bytes_total;
+  m_files_total = files_total;
+  m_start = std::chrono::steady_clock::now();
+  m_last_time = m_start;
+  m_last_bytes = 0;
+  m_average_rate = -1;
+}
+
+void Tracker::add_bytes(uint64_t bytes) {
+  m_bytes_done.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void Tracker::finish_file() {
+  m_files_done.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Tracker::set_current(const std::string &name) {
+  std::lock_guard<std::mutex> guard(m_current_lock);
+  m_current = name;
+}
+
+uint64_t Tracker::get_bytes_done() const {
+  return m_bytes_done.load(std::memory_order_relaxed);
+}
+
+snapshot Tracker::sample() {
+  std::lock_guard<std::mutex> guard(m_sample_lock);
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+  snapshot state;
+  state.bytes_done = m_bytes_done.load(std::memory_order_relaxed);
+  state.bytes_total = m_bytes_total;
+  state.files_done = m_files_done.load(std::memory_order_relaxed);
+  state.files_total = m_files_total;
+  {
+    std::lock_guard<std::mutex> current_guard(m_current_lock);
+    state.current_file = m_current;
+  }
+  state.elapsed = std::chrono::duration<double>(now - m_start).count();
+
+  double interval = std::chrono::duration<double>(now - m_last_time).count();
+  if (interval > 0) {
+    state.rate = (state.bytes_done - m_last_bytes) / BYTES_PER_MB / interval;
+
+    // Weight the new rate by how long it was measured over so irregular sampling does not skew the average
+    if (m_average_rate < 0) {
+      m_average_rate = state.rate;
+    } else {
+      double weight = 1 - std::exp(-interval / PROGRESS_AVERAGE_WINDOW);
+      m_average_rate += weight * (state.rate - m_average_rate);
+    }
+
+    m_last_time = now;
+    m_last_bytes = state.bytes_done;
+  } else {
+    state.rate = std::max(m_average_rate, 0.0);
+  }
+  state.average_rate = std::max(m_average_rate, 0.0);
+
+  if (state.bytes_done >= state.bytes_total) {
+    state.eta = 0;
+  } else if (m_average_rate > 0) {
+    state.eta = (state.bytes_total - state.bytes_done) / BYTES_PER_MB / m_average_rate;
+  } else {
+    state.eta = -1;
+  }
+
+  return state;
+}
+} // namespace progress
@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
@@ -133,6 +134,50 @@ std::vector<SfoData> read(const std::string &path) { // Flawfinder: ignore
   return data;
 }
 
+std::vector<SfoData> parse(const unsigned char *buffer, size_t size) {
+  // Same layout as read(), taken from memory (ex. the param.sfo entry of a PKG) instead of a file
+  SfoHeader header;
+  if (size < sizeof(header)) {
+    FATAL_ERROR("Error reading SFO header!");
+  }
+  std::memcpy(&header, buffer, sizeof(header));
+  if (__builtin_bswap32(header.magic) != SFO_MAGIC) {
+    FATAL_ERROR("Input buffer is not a SFO!");
+  }
+
+  // Key offset, format, length, max length and data offset of each entry follow the header
+  const size_t entry_size = sizeof(uint16_t) * 2 + sizeof(uint32_t) * 3;
+  if (header.num_entries > (size - sizeof(header)) / entry_size) {
+    FATAL_ERROR("Error reading entry table!");
+  }
+
+  std::vector<SfoData> data(header.num_entries);
+  const unsigned char *entry = buffer + sizeof(header);
+  for (auto &&temp_data : data) {
+    std::memcpy(&temp_data.key_offset, entry, sizeof(temp_data.key_offset));
+    std::memcpy(&temp_data.format, entry + 2, sizeof(temp_data.format));
+    std::memcpy(&temp_data.length, entry + 4, sizeof(temp_data.length));
+    std::memcpy(&temp_data.max_length, entry + 8, sizeof(temp_data.max_length));
+    std::memcpy(&temp_data.data_offset, entry + 12, sizeof(temp_data.data_offset));
+    entry += entry_size;
+
+    uint64_t key_offset = static_cast<uint64_t>(header.key_table_offset) + temp_data.key_offset;
+    if (key_offset >= size) {
+      FATAL_ERROR("Error reading key table!");
+    }
+    const char *key = reinterpret_cast<const char *>(buffer + key_offset);
+    temp_data.key_name.assign(key, strnlen(key, size - key_offset)); // Flawfinder: ignore
+
+    uint64_t data_offset = static_cast<uint64_t>(header.data_table_offset) + temp_data.data_offset;
+    if (data_offset > size || temp_data.length > size - data_offset) {
+      FATAL_ERROR("Error reading data table!");
+    }
+    temp_data.data.assign(buffer + data_offset, buffer + data_offset + temp_data.length);
+  }
+
+  return data;
+}
+
 std::vector<std::string> get_keys(const std::vector<SfoData> &data) {
   std::vector<std::string> temp_key_list;
   for (auto &&entry : data) {
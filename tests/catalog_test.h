@@ -0,0 +1,190 @@
+// Copyright (c) 2021 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_TESTS_CATALOG_TEST_H_
+#define DUMPER_TESTS_CATALOG_TEST_H_
+
+#include "catalog.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "fixtures.h"
+#include "sfo.h"
+#include "testing.h"
+
+// param.sfo written by sfo::write, keys with an empty value are left out
+static std::vector<unsigned char> catalog_test_sfo(const fixtures::TemporaryDirectory &directory, const std::map<std::string, std::string> &values) {
+  std::vector<sfo::SfoData> data;
+  for (auto &&value : values) {
+    if (!value.second.empty()) {
+      std::vector<unsigned char> bytes(value.second.begin(), value.second.end());
+      bytes.push_back('\0');
+      data = sfo::add_data(sfo::build_data(value.first, "utf-8", bytes.size(), (bytes.size() + 3) & ~3, bytes), data);
+    }
+  }
+  std::string sfo_path = directory.get_path("param.sfo");
+  sfo::write(data, sfo_path);
+  return fixtures::read_file(sfo_path); // Flawfinder: ignore
+}
+
+static void catalog_test_pkg(const fixtures::TemporaryDirectory &directory, const std::string &pkg_path, const std::string &content_id, const std::map<std::string, std::string> &values) {
+  fixtures::PkgBuilder builder;
+  builder.set_content_id(content_id);
+  builder.add_entry(0x0400, fixtures::random_data(64, 1));
+  builder.add_entry(0x1000, catalog_test_sfo(directory, values));
+  std::filesystem::create_directories(std::filesystem::path(pkg_path).parent_path());
+  builder.write(pkg_path);
+}
+
+static std::vector<catalog::entry> catalog_test_entries() {
+  std::vector<catalog::entry> entries(3);
+  entries[0] = {"/mnt/usb0/a.pkg", "UP0000-CUSA00001_00-GAME000000000000", 0x1A, 0xF, 123456789, "01.00", "Title \"quoted\"\\ \xC3\xA9"};
+  entries[1] = {"/mnt/usb0/b.pkg", "EP0000-CUSA00002_00-ADDCONT00000000", 0x1B, 0x3, 0, "", ""};
+  entries[2] = {std::string("/mnt/usb0/c\0d.pkg", 17), "JP0000-CUSA00003_00-PATCH00000000000", 0x1A, 0xF, UINT64_MAX, "99.99", "\t\n"};
+  return entries;
+}
+
+TEST(catalogTests, readEntry) {
+  fixtures::TemporaryDirectory directory;
+  catalog_test_pkg(directory, directory.get_path("game.pkg"), "UP0000-CUSA00001_00-GAME000000000000", {{"TITLE", "A Game"}, {"APP_VER", "01.05"}, {"VERSION", "01.00"}});
+  catalog::entry result = catalog::read_entry(directory.get_path("game.pkg")); // Flawfinder: ignore
+  EXPECT_EQ(directory.get_path("game.pkg"), result.path);
+  EXPECT_EQ("UP0000-CUSA00001_00-GAME000000000000", result.content_id);
+  EXPECT_EQ(0x1A, result.content_type);
+  EXPECT_EQ(0xF, result.drm_type);
+  EXPECT_EQ(std::filesystem::file_size(directory.get_path("game.pkg")), result.package_size);
+  EXPECT_EQ("A Game", result.title);
+  EXPECT_EQ("01.05", result.version);
+
+  // No APP_VER, as in DLC
+  catalog_test_pkg(directory, directory.get_path("dlc.pkg"), "EP0000-CUSA00002_00-ADDCONT00000000", {{"TITLE", "Extra"}, {"VERSION", "01.02"}});
+  result = catalog::read_entry(directory.get_path("dlc.pkg")); // Flawfinder: ignore
+  EXPECT_EQ("Extra", result.title);
+  EXPECT_EQ("01.02", result.version);
+
+  // No param.sfo at all
+  fixtures::PkgBuilder builder;
+  builder.set_content_id("JP0000-CUSA00003_00-NOSFO00000000000");
+  builder.add_entry(0x0400, fixtures::random_data(64, 2));
+  builder.write(directory.get_path("nosfo.pkg"));
+  result = catalog::read_entry(directory.get_path("nosfo.pkg")); // Flawfinder: ignore
+  EXPECT_EQ("JP0000-CUSA00003_00-NOSFO00000000000", result.content_id);
+  EXPECT_TRUE(result.title.empty());
+  EXPECT_TRUE(result.version.empty());
+
+  fixtures::write_file(directory.get_path("bad.pkg"), std::vector<unsigned char>(40, 'x'));
+  EXPECT_EXCEPTION_REGEX(catalog::read_entry(directory.get_path("bad.pkg")), "^Error: Error reading PKG header! at \"pkg\\.cpp\":\\d*:\\(Package\\)$", "Cataloged a broken PKG"); // Flawfinder: ignore
+}
+
+TEST(catalogTests, scan) {
+  fixtures::TemporaryDirectory directory;
+  std::string library_path = directory.get_path("library");
+  catalog_test_pkg(directory, library_path + "/b/valid.pkg", "UP0000-CUSA00001_00-GAME000000000000", {{"TITLE", "Valid"}, {"APP_VER", "01.00"}});
+  catalog_test_pkg(directory, library_path + "/a/upper.PKG", "UP0000-CUSA00002_00-GAME000000000000", {{"TITLE", "Upper"}, {"APP_VER", "02.00"}});
+  fixtures::write_file(library_path + "/a/corrupt.pkg", std::vector<unsigned char>(0x2000, 'x'));
+  fixtures::write_file(library_path + "/notes.txt", {'x'});
+  std::filesystem::create_symlink("loop.pkg", library_path + "/a/loop.pkg"); // Cannot be stat'd, the walk goes on past it
+
+  // Empty input arguments
+  EXPECT_EXCEPTION_REGEX(catalog::scan(""), "^Error: Empty input path argument! at \"catalog\\.cpp\":\\d*:\\(scan\\)$", "Accepted empty argument");
+  EXPECT_EXCEPTION_REGEX(catalog::scan(" \t"), "^Error: Empty input path argument! at \"catalog\\.cpp\":\\d*:\\(scan\\)$", "Accepted whitespace argument");
+  EXPECT_EXCEPTION_REGEX(catalog::scan(library_path + "/notes.txt"), "^Error: Input path does not exist or is not a directory! at \"catalog\\.cpp\":\\d*:\\(scan\\)$", "Scanned a file");
+
+  // Same result with one worker and several, sorted by path, the broken one reported instead of stopping the scan
+  for (uint32_t workers : {1, 4}) {
+    std::vector<std::string> failed;
+    std::vector<catalog::entry> entries = catalog::scan(library_path, workers, &failed);
+    ASSERT_EQ(2, entries.size());
+    EXPECT_EQ(library_path + "/a/upper.PKG", entries[0].path);
+    EXPECT_EQ("Upper", entries[0].title);
+    EXPECT_EQ("02.00", entries[0].version);
+    EXPECT_EQ(library_path + "/b/valid.pkg", entries[1].path);
+    EXPECT_EQ("UP0000-CUSA00001_00-GAME000000000000", entries[1].content_id);
+    EXPECT_EQ(std::vector<std::string>({library_path + "/a/corrupt.pkg", library_path + "/a/loop.pkg"}), failed);
+  }
+
+  EXPECT_TRUE(catalog::scan(directory.get_path()).size() == 2); // Without a failed list
+  std::filesystem::create_directory(directory.get_path("empty"));
+  EXPECT_TRUE(catalog::scan(directory.get_path("empty")).empty());
+}
+
+TEST(catalogTests, writeJson) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<catalog::entry> entries = catalog_test_entries();
+  entries.resize(2);
+  catalog::write_json(entries, directory.get_path("catalog.json"));
+
+  std::vector<unsigned char> data = fixtures::read_file(directory.get_path("catalog.json")); // Flawfinder: ignore
+  std::string json(data.begin(), data.end());
+  EXPECT_EQ("[\n"
+            "  {\"path\": \"/mnt/usb0/a.pkg\", \"content_id\": \"UP0000-CUSA00001_00-GAME000000000000\", \"content_type\": 26, \"drm_type\": 15, \"package_size\": 123456789, \"version\": \"01.00\", \"title\": \"Title \\\"quoted\\\"\\\\ \xC3\xA9\"},\n"
+            "  {\"path\": \"/mnt/usb0/b.pkg\", \"content_id\": \"EP0000-CUSA00002_00-ADDCONT00000000\", \"content_type\": 27, \"drm_type\": 3, \"package_size\": 0, \"version\": \"\", \"title\": \"\"}\n"
+            "]\n",
+            json);
+
+  catalog::write_json({}, directory.get_path("empty.json"));
+  data = fixtures::read_file(directory.get_path("empty.json")); // Flawfinder: ignore
+  EXPECT_EQ("[\n]\n", std::string(data.begin(), data.end()));
+
+  EXPECT_EXCEPTION_REGEX(catalog::write_json(entries, directory.get_path("missing/catalog.json")), "^Error: Cannot open file: .* at \"catalog\\.cpp\":\\d*:\\(write_json\\)$", "Wrote into a missing directory");
+}
+
+TEST(catalogTests, writeBinary) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<catalog::entry> entries = catalog_test_entries();
+  catalog::write_binary(entries, directory.get_path("catalog.bin"));
+  EXPECT_FALSE(std::filesystem::exists(directory.get_path("catalog.bin.tmp")));
+
+  // Round trip, a string with an embedded NUL is cut there
+  std::vector<catalog::entry> loaded = catalog::read_binary(directory.get_path("catalog.bin")); // Flawfinder: ignore
+  ASSERT_EQ(entries.size(), loaded.size());
+  entries[2].path = "/mnt/usb0/c";
+  for (size_t i = 0; i < entries.size(); i++) {
+    EXPECT_EQ(entries[i].path, loaded[i].path);
+    EXPECT_EQ(entries[i].content_id, loaded[i].content_id);
+    EXPECT_EQ(entries[i].content_type, loaded[i].content_type);
+    EXPECT_EQ(entries[i].drm_type, loaded[i].drm_type);
+    EXPECT_EQ(entries[i].package_size, loaded[i].package_size);
+    EXPECT_EQ(entries[i].version, loaded[i].version);
+    EXPECT_EQ(entries[i].title, loaded[i].title);
+  }
+
+  // Replaces an existing catalog
+  catalog::write_binary({}, directory.get_path("catalog.bin"));
+  EXPECT_TRUE(catalog::read_binary(directory.get_path("catalog.bin")).empty()); // Flawfinder: ignore
+
+  EXPECT_EXCEPTION_REGEX(catalog::write_binary(entries, directory.get_path("missing/catalog.bin")), "^Error: Cannot open file: .* at \"catalog\\.cpp\":\\d*:\\(write_binary\\)$", "Wrote into a missing directory");
+}
+
+TEST(catalogTests, readBinary) {
+  fixtures::TemporaryDirectory directory;
+  catalog::write_binary(catalog_test_entries(), directory.get_path("catalog.bin"));
+  std::vector<unsigned char> data = fixtures::read_file(directory.get_path("catalog.bin")); // Flawfinder: ignore
+
+  EXPECT_EXCEPTION_REGEX(catalog::read_binary(directory.get_path("doesNotExist.bin")), "^Error: Cannot open file: .* at \"catalog\\.cpp\":\\d*:\\(read_binary\\)$", "Read a missing catalog"); // Flawfinder: ignore
+
+  fixtures::write_file(directory.get_path("short.bin"), std::vector<unsigned char>(data.begin(), data.begin() + sizeof(catalog::header) - 1));
+  EXPECT_EXCEPTION_REGEX(catalog::read_binary(directory.get_path("short.bin")), "^Error: Error reading catalog header! at \"catalog\\.cpp\":\\d*:\\(read_binary\\)$", "Read a truncated header"); // Flawfinder: ignore
+
+  std::vector<unsigned char> broken = data;
+  reinterpret_cast<catalog::header *>(&broken[0])->record_size++;
+  fixtures::write_file(directory.get_path("layout.bin"), broken);
+  EXPECT_EXCEPTION_REGEX(catalog::read_binary(directory.get_path("layout.bin")), "^Error: Input path is not a catalog! at \"catalog\\.cpp\":\\d*:\\(read_binary\\)$", "Read a catalog of another layout"); // Flawfinder: ignore
+
+  broken = std::vector<unsigned char>(data.begin(), data.end() - 1);
+  fixtures::write_file(directory.get_path("truncated.bin"), broken);
+  EXPECT_EXCEPTION_REGEX(catalog::read_binary(directory.get_path("truncated.bin")), "^Error: Error reading catalog records! at \"catalog\\.cpp\":\\d*:\\(read_binary\\)$", "Read a truncated string table"); // Flawfinder: ignore
+
+  broken = data;
+  reinterpret_cast<catalog::record *>(&broken[sizeof(catalog::header)])->title_offset = reinterpret_cast<catalog::header *>(&broken[0])->strings_size;
+  fixtures::write_file(directory.get_path("string.bin"), broken);
+  EXPECT_EXCEPTION_REGEX(catalog::read_binary(directory.get_path("string.bin")), "^Error: Error reading catalog strings! at \"catalog\\.cpp\":\\d*:\\(operator\\(\\)\\)$", "Followed a string offset out of the table"); // Flawfinder: ignore
+}
+
+#endif // DUMPER_TESTS_CATALOG_TEST_H_
@@ -0,0 +1,422 @@
+// Copyright (c) 2021 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_TESTS_FIXTURES_H_
+#define DUMPER_TESTS_FIXTURES_H_
+
+#include <openssl/sha.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "pfs.h"
+#include "pfsc.h"
+#include "pkg.h"
+
+// Inputs generated in memory by the tests themselves, so no binary files have to be checked in
+namespace fixtures {
+// Scratch directory under the system temporary directory, removed with everything in it on destruction
+class TemporaryDirectory {
+public:
+  TemporaryDirectory() {
+    static std::atomic<uint32_t> counter(0);
+    m_path = std::filesystem::temp_directory_path() / ("dumper_test_" + std::to_string(getpid()) + "_" + std::to_string(counter++));
+    std::filesystem::remove_all(m_path);
+    std::filesystem::create_directories(m_path);
+  }
+
+  ~TemporaryDirectory() {
+    std::error_code error;
+    std::filesystem::remove_all(m_path, error);
+  }
+
+  TemporaryDirectory(const TemporaryDirectory &) = delete;
+  TemporaryDirectory &operator=(const TemporaryDirectory &) = delete;
+
+  std::string get_path(const std::string &name = "") const {
+    return name.empty() ? m_path.string() : (m_path / name).string();
+  }
+
+private:
+  std::filesystem::path m_path;
+};
+
+// Same bytes for the same seed on every run
+inline std::vector<unsigned char> random_data(size_t size, uint32_t seed) {
+  std::mt19937 generator(seed);
+  std::vector<unsigned char> data(size);
+  for (auto &&byte : data) {
+    byte = static_cast<unsigned char>(generator());
+  }
+  return data;
+}
+
+inline void write_file(const std::string &path, const std::vector<unsigned char> &data) {
+  std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(data.data()), data.size());
+}
+
+inline std::vector<unsigned char> read_file(const std::string &path) { // Flawfinder: ignore
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  return std::vector<unsigned char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// PFSC stream of `data`: odd all-zero blocks are stored empty and blocks zlib cannot shrink are stored raw at full block size
+inline std::vector<unsigned char> make_pfsc(const std::vector<unsigned char> &data, uint32_t block_size) {
+  uint64_t block_count = (data.size() + block_size - 1) / block_size;
+  pfsc::PfscHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = PFSC_MAGIC;
+  header.unk_0x08 = 6;
+  header.block_size = block_size;
+  header.block_size2 = block_size;
+  header.block_offsets = 0x400;
+  header.data_start = header.block_offsets + (block_count + 1) * sizeof(uint64_t);
+  header.data_length = data.size();
+
+  std::vector<unsigned char> stream(header.data_start, 0);
+  std::memcpy(&stream[0], &header, sizeof(header));
+  std::vector<uint64_t> offsets;
+  for (uint64_t i = 0; i < block_count; i++) {
+    offsets.push_back(stream.size());
+    std::vector<unsigned char> block(data.begin() + i * block_size, data.begin() + std::min<uint64_t>(data.size(), (i + 1) * block_size));
+    if (i % 2 == 1 && std::all_of(block.begin(), block.end(), [](unsigned char c) { return c == 0; })) {
+      continue;
+    }
+    uLongf compressed_size = compressBound(block.size());
+    std::vector<unsigned char> compressed(compressed_size);
+    compress2(compressed.data(), &compressed_size, block.data(), block.size(), 6);
+    if (compressed_size >= block_size) {
+      block.resize(block_size, 0);
+      stream.insert(stream.end(), block.begin(), block.end());
+    } else {
+      stream.insert(stream.end(), compressed.begin(), compressed.begin() + compressed_size);
+    }
+  }
+  offsets.push_back(stream.size());
+  std::memcpy(&stream[header.block_offsets], offsets.data(), offsets.size() * sizeof(uint64_t));
+  return stream;
+}
+
+// Builds a PFS image the way pfs::Image expects to find one
+// Inode 0 is the superroot, 1 its flat_path_table and 2 "uroot", the root of the tree added here
+// Blocks are laid out in the order things are added, files past PFS_DIRECT_BLOCKS blocks get single and double indirect blocks
+class PfsBuilder {
+public:
+  explicit PfsBuilder(uint32_t block_size = 0x1000) : m_block_size(block_size), m_fragmented(false) {
+    m_nodes.push_back({true, {}, 0, 0, {{0, 4, "."}, {0, 5, ".."}, {1, 2, "flat_path_table"}, {2, 3, "uroot"}}});
+    m_nodes.push_back({false, std::vector<unsigned char>(16, 0), 16, 0, {}});
+    m_nodes.push_back({true, {}, 0, 0, {{2, 4, "."}, {0, 5, ".."}}});
+    m_inodes[""] = 2;
+  }
+
+  // Files of more than one block take every other block, so no two blocks of a file are adjacent
+  void set_fragmented(bool fragmented) {
+    m_fragmented = fragmented;
+  }
+
+  uint32_t add_directory(const std::string &path) {
+    auto existing = m_inodes.find(path);
+    if (existing != m_inodes.end()) {
+      return existing->second;
+    }
+    uint32_t parent = add_directory(get_parent(path));
+    uint32_t ino = m_nodes.size();
+    m_nodes.push_back({true, {}, 0, 0, {{ino, 4, "."}, {parent, 5, ".."}}});
+    m_nodes[parent].entries.push_back({ino, 3, get_name(path)});
+    m_inodes[path] = ino;
+    return ino;
+  }
+
+  uint32_t add_file(const std::string &path, const std::vector<unsigned char> &data) {
+    return add_node(path, {false, data, data.size(), 0, {}});
+  }
+
+  // Stored as a PFSC stream of `block_size` blocks, read back through pfsc like a compressed file of a real image
+  uint32_t add_compressed_file(const std::string &path, const std::vector<unsigned char> &data, uint32_t block_size = 0x10000) {
+    return add_node(path, {false, make_pfsc(data, block_size), data.size(), PFS_INODE_COMPRESSED, {}});
+  }
+
+  // Another directory entry for the inode of `target`
+  void add_link(const std::string &path, const std::string &target) {
+    uint32_t parent = add_directory(get_parent(path));
+    m_nodes[parent].entries.push_back({m_inodes.at(target), 2, get_name(path)});
+  }
+
+  std::vector<unsigned char> build() const {
+    std::vector<node> nodes = m_nodes;
+    for (auto &&directory : nodes) {
+      if (directory.directory) {
+        directory.data = get_directory_data(directory.entries);
+        directory.size = directory.data.size();
+      }
+    }
+
+    uint64_t inodes_per_block = m_block_size / sizeof(pfs::di_d32);
+    uint64_t inode_blocks = (nodes.size() + inodes_per_block - 1) / inodes_per_block;
+    uint32_t next = 1 + inode_blocks;
+    std::map<uint32_t, std::vector<unsigned char>> blocks;
+
+    std::vector<pfs::di_d32> inodes(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+      const node &current = nodes[i];
+      uint32_t count = std::max<uint64_t>(1, (current.data.size() + m_block_size - 1) / m_block_size);
+      std::vector<uint32_t> block_list;
+      for (uint32_t j = 0; j < count; j++) {
+        block_list.push_back(next);
+        next += m_fragmented && !current.directory && count > 1 ? 2 : 1;
+      }
+      for (uint32_t j = 0; j < count; j++) {
+        size_t start = static_cast<size_t>(j) * m_block_size;
+        if (start < current.data.size()) {
+          blocks[block_list[j]].assign(current.data.begin() + start, current.data.begin() + std::min<size_t>(current.data.size(), start + m_block_size));
+        }
+      }
+
+      pfs::di_d32 &inode = inodes[i];
+      std::memset(&inode, 0, sizeof(inode));
+      inode.mode = current.directory ? 0x4000 : 0x8000;
+      inode.nlink = 1;
+      inode.flags = current.flags;
+      inode.size = current.size;
+      inode.size_compressed = current.data.size();
+      inode.blocks = count;
+      for (uint32_t j = 0; j < count && j < PFS_DIRECT_BLOCKS; j++) {
+        inode.db[j] = block_list[j];
+      }
+
+      // One single indirect block, then a double indirect block for whatever is left
+      uint32_t pointers = m_block_size / sizeof(uint32_t);
+      std::vector<uint32_t> rest(block_list.begin() + std::min<size_t>(block_list.size(), PFS_DIRECT_BLOCKS), block_list.end());
+      if (!rest.empty()) {
+        std::vector<uint32_t> first(rest.begin(), rest.begin() + std::min<size_t>(rest.size(), pointers));
+        inode.ib[0] = next++;
+        blocks[inode.ib[0]] = get_pointer_block(first);
+        rest.erase(rest.begin(), rest.begin() + first.size());
+      }
+      if (!rest.empty()) {
+        inode.ib[1] = next++;
+        std::vector<uint32_t> second;
+        while (!rest.empty()) {
+          std::vector<uint32_t> piece(rest.begin(), rest.begin() + std::min<size_t>(rest.size(), pointers));
+          second.push_back(next);
+          blocks[next++] = get_pointer_block(piece);
+          rest.erase(rest.begin(), rest.begin() + piece.size());
+        }
+        blocks[inode.ib[1]] = get_pointer_block(second);
+      }
+    }
+
+    std::vector<unsigned char> image(static_cast<size_t>(next) * m_block_size, 0);
+    pfs::pfs_header header;
+    std::memset(&header, 0, sizeof(header));
+    header.version = 1;
+    header.magic = __builtin_bswap64(PFS_MAGIC);
+    header.blocksz = m_block_size;
+    header.nblock = next;
+    header.ndinode = nodes.size();
+    header.ndinodeblock = inode_blocks;
+    header.superroot_ino = 0;
+    std::memcpy(&image[0], &header, sizeof(header));
+    for (size_t i = 0; i < inodes.size(); i++) {
+      uint64_t offset = m_block_size * (1 + i / inodes_per_block) + sizeof(pfs::di_d32) * (i % inodes_per_block);
+      std::memcpy(&image[offset], &inodes[i], sizeof(pfs::di_d32));
+    }
+    for (auto &&block : blocks) {
+      std::memcpy(&image[static_cast<size_t>(block.first) * m_block_size], block.second.data(), block.second.size());
+    }
+    return image;
+  }
+
+  void write(const std::string &image_path) const {
+    write_file(image_path, build());
+  }
+
+protected:
+  typedef struct {
+    uint32_t ino;
+    uint32_t type;
+    std::string name;
+  } entry;
+
+  typedef struct {
+    bool directory;
+    std::vector<unsigned char> data; // Stored bytes, a PFSC stream for compressed files
+    uint64_t size;                   // di_d32::size, the decompressed size for compressed files
+    uint32_t flags;
+    std::vector<entry> entries;
+  } node;
+
+  uint32_t add_node(const std::string &path, const node &file) {
+    uint32_t parent = add_directory(get_parent(path));
+    uint32_t ino = m_nodes.size();
+    m_nodes.push_back(file);
+    m_nodes[parent].entries.push_back({ino, 2, get_name(path)});
+    m_inodes[path] = ino;
+    return ino;
+  }
+
+private:
+  static std::string get_parent(const std::string &path) {
+    size_t separator = path.rfind('/');
+    return separator == std::string::npos ? "" : path.substr(0, separator);
+  }
+
+  static std::string get_name(const std::string &path) {
+    size_t separator = path.rfind('/');
+    return separator == std::string::npos ? path : path.substr(separator + 1);
+  }
+
+  // Entries never cross a block boundary, the rest of a block that cannot fit the next one is left zeroed
+  std::vector<unsigned char> get_directory_data(const std::vector<entry> &entries) const {
+    std::vector<unsigned char> data;
+    for (auto &&current : entries) {
+      pfs::dirent_t dirent;
+      dirent.ino = current.ino;
+      dirent.type = current.type;
+      dirent.namelen = current.name.size();
+      dirent.entsize = (sizeof(dirent) + current.name.size() + 1 + 7) & ~7;
+      if (data.size() / m_block_size != (data.size() + dirent.entsize - 1) / m_block_size) {
+        data.resize((data.size() / m_block_size + 1) * m_block_size, 0);
+      }
+      size_t offset = data.size();
+      data.resize(offset + dirent.entsize, 0);
+      std::memcpy(&data[offset], &dirent, sizeof(dirent));
+      std::memcpy(&data[offset + sizeof(dirent)], current.name.data(), current.name.size());
+    }
+    return data;
+  }
+
+  std::vector<unsigned char> get_pointer_block(const std::vector<uint32_t> &pointers) const {
+    std::vector<unsigned char> block(pointers.size() * sizeof(uint32_t));
+    std::memcpy(block.data(), pointers.data(), block.size());
+    return block;
+  }
+
+  uint32_t m_block_size;
+  bool m_fragmented;
+  std::vector<node> m_nodes;
+  std::map<std::string, uint32_t> m_inodes;
+};
+// Builds a PKG with a valid entry table and header digests, laid out as header, entry table and data, body padding, then the PFS image
+// Every digest verify() checks is filled in, entries with an id below 0x1000 are counted as sc entries
+class PkgBuilder {
+public:
+  PkgBuilder() : m_content_type(0x1A), m_drm_type(0xF), m_signed_size(0x10000) {}
+
+  void set_content_id(const std::string &content_id) {
+    m_content_id = content_id;
+  }
+
+  void set_content_type(uint32_t content_type) {
+    m_content_type = content_type;
+  }
+
+  void add_entry(uint32_t id, const std::vector<unsigned char> &data, uint32_t flags1 = 0) {
+    m_entries.push_back({id, data, flags1});
+  }
+
+  // `signed_size` is clamped to the image size
+  void set_pfs_image(const std::vector<unsigned char> &image, uint32_t signed_size = 0x10000) {
+    m_pfs_image = image;
+    m_signed_size = signed_size;
+  }
+
+  std::vector<unsigned char> build() const {
+    uint64_t table_offset = 0x2A80;
+    std::vector<unsigned char> data(table_offset + m_entries.size() * sizeof(pkg::PkgTableEntry), 0);
+    uint16_t sc_entry_count = 0;
+    for (size_t i = 0; i < m_entries.size(); i++) {
+      data.resize((data.size() + 0xF) & ~0xF, 0);
+      pkg::PkgTableEntry entry;
+      std::memset(&entry, 0, sizeof(entry));
+      entry.id = __builtin_bswap32(m_entries[i].id);
+      entry.flags1 = __builtin_bswap32(m_entries[i].flags1);
+      entry.offset = __builtin_bswap32(data.size());
+      entry.size = __builtin_bswap32(m_entries[i].data.size());
+      std::memcpy(&data[table_offset + i * sizeof(entry)], &entry, sizeof(entry));
+      data.insert(data.end(), m_entries[i].data.begin(), m_entries[i].data.end());
+      if (m_entries[i].id < 0x1000) {
+        sc_entry_count++;
+      }
+    }
+    uint64_t main_size = data.size() - table_offset;
+
+    // Body runs from the end of the header up to the PFS image
+    uint64_t body_offset = 0x2000;
+    data.resize(((data.size() + 0xFFFF) & ~0xFFFF) + 0x10000, 0);
+    uint64_t pfs_offset = data.size();
+    data.insert(data.end(), m_pfs_image.begin(), m_pfs_image.end());
+    data.resize(data.size() + 0x100, 0);
+
+    pkg::PkgHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = __builtin_bswap32(PKG_MAGIC);
+    header.entry_count = __builtin_bswap32(m_entries.size());
+    header.sc_entry_count = __builtin_bswap16(sc_entry_count);
+    header.entry_count_2 = __builtin_bswap16(m_entries.size());
+    header.entry_table_offset = __builtin_bswap32(table_offset);
+    header.main_ent_data_size = __builtin_bswap32(main_size);
+    header.body_offset = __builtin_bswap64(body_offset);
+    header.body_size = __builtin_bswap64(pfs_offset - body_offset);
+    std::memcpy(header.content_id, m_content_id.data(), std::min(m_content_id.size(), sizeof(header.content_id)));
+    header.drm_type = __builtin_bswap32(m_drm_type);
+    header.content_type = __builtin_bswap32(m_content_type);
+    header.pfs_image_count = __builtin_bswap32(m_pfs_image.empty() ? 0 : 1);
+    header.pfs_image_offset = __builtin_bswap64(m_pfs_image.empty() ? 0 : pfs_offset);
+    header.pfs_image_size = __builtin_bswap64(m_pfs_image.size());
+    header.package_size = __builtin_bswap64(data.size());
+    header.pfs_signed_size = __builtin_bswap32(std::min<uint64_t>(m_signed_size, m_pfs_image.size()));
+
+    get_digest(data, table_offset, main_size, header.sc_entries1_hash);
+    get_digest(data, table_offset, sc_entry_count * sizeof(pkg::PkgTableEntry), header.sc_entries2_hash);
+    for (auto &&entry : m_entries) {
+      if (entry.id == 0x0001) {
+        get_digest(entry.data, 0, entry.data.size(), header.digest_table_hash);
+      }
+    }
+    get_digest(data, body_offset, pfs_offset - body_offset, header.body_digest);
+    get_digest(data, pfs_offset, m_pfs_image.size(), header.pfs_image_digest);
+    get_digest(data, pfs_offset, std::min<uint64_t>(m_signed_size, m_pfs_image.size()), header.pfs_signed_digest);
+
+    // The header is hashed by none of the digests, so it can go in last
+    std::memcpy(&data[0], &header, sizeof(header));
+    return data;
+  }
+
+  void write(const std::string &pkg_path) const {
+    write_file(pkg_path, build());
+  }
+
+private:
+  typedef struct {
+    uint32_t id;
+    std::vector<unsigned char> data;
+    uint32_t flags1;
+  } entry;
+
+  static void get_digest(const std::vector<unsigned char> &data, uint64_t offset, uint64_t size, unsigned char *digest) {
+    SHA256(data.data() + offset, size, digest);
+  }
+
+  std::string m_content_id;
+  uint32_t m_content_type;
+  uint32_t m_drm_type;
+  std::vector<entry> m_entries;
+  std::vector<unsigned char> m_pfs_image;
+  uint32_t m_signed_size;
+};
+} // namespace fixtures
+
+#endif // DUMPER_TESTS_FIXTURES_H_
@@ -0,0 +1,310 @@
+// Copyright (c) 2021 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_TESTS_IO_TEST_H_
+#define DUMPER_TESTS_IO_TEST_H_
+
+#include "io.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "fixtures.h"
+#include "testing.h"
+
+TEST(ioTests, mappedFile) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = fixtures::random_data(10000, 1);
+  fixtures::write_file(directory.get_path("input"), data);
+
+  io::MappedFile map;
+  EXPECT_FALSE(map.is_mapped());
+  io::FileDescriptor fd(open(directory.get_path("input").c_str(), O_RDONLY)); // Flawfinder: ignore
+  ASSERT_TRUE(fd.is_open());
+  map.map(fd.get());
+  ASSERT_TRUE(map.is_mapped());
+  EXPECT_EQ(data.size(), map.get_size());
+  EXPECT_EQ(0, std::memcmp(map.get_data(), data.data(), data.size()));
+  map.unmap();
+  EXPECT_FALSE(map.is_mapped());
+  EXPECT_EQ(0, map.get_size());
+
+  // Empty files have nothing to map
+  fixtures::write_file(directory.get_path("empty"), {});
+  io::FileDescriptor empty_fd(open(directory.get_path("empty").c_str(), O_RDONLY)); // Flawfinder: ignore
+  map.map(empty_fd.get());
+  EXPECT_EQ(0, map.get_size());
+
+  EXPECT_EXCEPTION_REGEX(map.map(-1), "^Error: Unable to stat file for mapping! at \"io\\.cpp\":\\d*:\\(map\\)$", "Mapped an invalid descriptor");
+}
+
+TEST(ioTests, directoryTree) {
+  fixtures::TemporaryDirectory directory;
+  io::DirectoryTree tree;
+  EXPECT_FALSE(tree.is_open());
+  EXPECT_FALSE(tree.open(directory.get_path("root"))); // The root has to exist already
+  std::filesystem::create_directory(directory.get_path("root"));
+  ASSERT_TRUE(tree.open(directory.get_path("root")));
+  EXPECT_TRUE(tree.is_open());
+  EXPECT_EQ(directory.get_path("root"), tree.get_root());
+
+  EXPECT_TRUE(tree.create("a/b/c"));
+  EXPECT_TRUE(tree.create("a/b/c")); // Already there
+  EXPECT_TRUE(std::filesystem::is_directory(directory.get_path("root/a/b/c")));
+
+  int fd = tree.open_file("a/b/file", O_WRONLY | O_CREAT | O_TRUNC);
+  ASSERT_GE(fd, 0);
+  io::pwrite_all(fd, "data", 4, 0);
+  close(fd);
+  EXPECT_EQ(4, std::filesystem::file_size(directory.get_path("root/a/b/file")));
+
+  // A file is in the way of a directory
+  EXPECT_FALSE(tree.create("a/b/file/d"));
+  EXPECT_LT(tree.open_file("a/b/file/d/e", O_WRONLY | O_CREAT), 0);
+
+  tree.close();
+  EXPECT_FALSE(tree.is_open());
+}
+
+TEST(ioTests, preadAll) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = fixtures::random_data(5000, 2);
+  fixtures::write_file(directory.get_path("input"), data);
+  io::FileDescriptor fd(open(directory.get_path("input").c_str(), O_RDONLY)); // Flawfinder: ignore
+
+  std::vector<unsigned char> buffer(1000);
+  io::pread_all(fd.get(), buffer.data(), buffer.size(), 4000);
+  EXPECT_EQ(0, std::memcmp(buffer.data(), &data[4000], buffer.size()));
+
+  EXPECT_EXCEPTION_REGEX(io::pread_all(fd.get(), buffer.data(), buffer.size(), 4500), "^Error: Error reading data! at \"io\\.cpp\":\\d*:\\(pread_all\\)$", "Read past the end of the file");
+  EXPECT_EXCEPTION_REGEX(io::pread_all(-1, buffer.data(), buffer.size(), 0), "^Error: Error reading data! at \"io\\.cpp\":\\d*:\\(pread_all\\)$", "Read an invalid descriptor");
+}
+
+TEST(ioTests, pwriteAll) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = fixtures::random_data(5000, 3);
+  io::FileDescriptor fd(open(directory.get_path("output").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)); // Flawfinder: ignore
+  io::pwrite_all(fd.get(), &data[2000], 3000, 2000);
+  io::pwrite_all(fd.get(), &data[0], 2000, 0);
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("output")) == data); // Flawfinder: ignore
+
+  io::FileDescriptor read_only(open(directory.get_path("output").c_str(), O_RDONLY)); // Flawfinder: ignore
+  EXPECT_EXCEPTION_REGEX(io::pwrite_all(read_only.get(), data.data(), data.size(), 0), "^Error: Error writing data! at \"io\\.cpp\":\\d*:\\(pwrite_all\\)$", "Wrote to a read only descriptor");
+}
+
+TEST(ioTests, preallocate) {
+  fixtures::TemporaryDirectory directory;
+  io::FileDescriptor fd(open(directory.get_path("output").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)); // Flawfinder: ignore
+  EXPECT_TRUE(io::preallocate(fd.get(), 0));
+  EXPECT_EQ(0, std::filesystem::file_size(directory.get_path("output")));
+
+  // Not every filesystem can, but one that does reserves the full size and reads back zeros
+  if (io::preallocate(fd.get(), 0x10000)) {
+    EXPECT_EQ(0x10000, std::filesystem::file_size(directory.get_path("output")));
+    EXPECT_TRUE(fixtures::read_file(directory.get_path("output")) == std::vector<unsigned char>(0x10000, 0)); // Flawfinder: ignore
+  }
+
+  io::FileDescriptor read_only(open(directory.get_path("output").c_str(), O_RDONLY)); // Flawfinder: ignore
+  EXPECT_FALSE(io::preallocate(read_only.get(), 0x20000));
+}
+
+TEST(ioTests, getFreeSpace) {
+  fixtures::TemporaryDirectory directory;
+  uint64_t block_size = 0;
+  io::get_free_space(directory.get_path(), &block_size);
+  EXPECT_GT(block_size, 0);
+
+  EXPECT_EXCEPTION_REGEX(io::get_free_space(directory.get_path("doesNotExist")), "^Error: Cannot get free space of: .* at \"io\\.cpp\":\\d*:\\(get_free_space\\)$", "Got the free space of a missing path");
+}
+
+TEST(ioTests, fileDescriptor) {
+  fixtures::TemporaryDirectory directory;
+  fixtures::write_file(directory.get_path("input"), {1});
+
+  io::FileDescriptor empty;
+  EXPECT_FALSE(empty.is_open());
+  EXPECT_EQ(-1, empty.get());
+
+  int raw_fd;
+  {
+    io::FileDescriptor fd(open(directory.get_path("input").c_str(), O_RDONLY)); // Flawfinder: ignore
+    ASSERT_TRUE(fd.is_open());
+    raw_fd = fd.get();
+
+    // Reset closes the old descriptor
+    int other = open(directory.get_path("input").c_str(), O_RDONLY); // Flawfinder: ignore
+    fd.reset(other);
+    EXPECT_EQ(-1, fcntl(raw_fd, F_GETFD));
+    EXPECT_EQ(other, fd.get());
+    raw_fd = other;
+  }
+  EXPECT_EQ(-1, fcntl(raw_fd, F_GETFD)); // Closed on destruction
+}
+
+TEST(ioTests, isZero) {
+  std::vector<unsigned char> buffer(200, 0);
+  EXPECT_TRUE(io::is_zero(&buffer[0], buffer.size()));
+  EXPECT_TRUE(io::is_zero(&buffer[0], 0));
+  buffer[130] = 1;
+  EXPECT_FALSE(io::is_zero(&buffer[0], buffer.size()));
+  EXPECT_TRUE(io::is_zero(&buffer[0], 130));
+  buffer[199] = 1;
+  EXPECT_FALSE(io::is_zero(&buffer[131], 69));
+}
+
+TEST(ioTests, pwriteSparse) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data(16 * IO_SPARSE_BLOCK, 0);
+  data[0] = 1;                                 // First piece
+  data[5 * IO_SPARSE_BLOCK + 10] = 2;          // Two neighbouring pieces, written as one
+  data[6 * IO_SPARSE_BLOCK] = 3;               //
+  data[data.size() - 1] = 4;                   // Last piece
+  std::vector<unsigned char> tail(100, 0);     // Shorter than a piece, all zeros
+  data.insert(data.end(), tail.begin(), tail.end());
+
+  io::FileDescriptor fd(open(directory.get_path("output").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)); // Flawfinder: ignore
+  EXPECT_EQ(12 * IO_SPARSE_BLOCK + tail.size(), io::pwrite_sparse(fd.get(), data.data(), data.size(), 0));
+  EXPECT_EQ(data.size() - tail.size(), std::filesystem::file_size(directory.get_path("output")));
+  ASSERT_EQ(0, ftruncate(fd.get(), data.size()));
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("output")) == data); // Flawfinder: ignore
+
+  // Only written pieces take up space, as far as the filesystem supports holes
+  struct stat st;
+  ASSERT_EQ(0, fstat(fd.get(), &st));
+  EXPECT_LE(static_cast<uint64_t>(st.st_blocks) * 512, data.size());
+
+  // Skipped pieces leave whatever was there before, the caller writes to a new or truncated file
+  std::vector<unsigned char> zeros(IO_SPARSE_BLOCK, 0);
+  EXPECT_EQ(zeros.size(), io::pwrite_sparse(fd.get(), zeros.data(), zeros.size(), 0));
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("output")) == data); // Flawfinder: ignore
+}
+
+TEST(ioTests, pipeline) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = fixtures::random_data(3 * IO_PIPELINE_BUFFER_SIZE + 1234, 4);
+  fixtures::write_file(directory.get_path("input"), data);
+  io::FileDescriptor input_fd(open(directory.get_path("input").c_str(), O_RDONLY)); // Flawfinder: ignore
+
+  // Several ranges, some longer than a buffer, written out of input order
+  std::vector<io::copy_range> ranges = {
+      {IO_PIPELINE_BUFFER_SIZE, 0, 2 * IO_PIPELINE_BUFFER_SIZE + 1234},
+      {0, 2 * IO_PIPELINE_BUFFER_SIZE + 1234, IO_PIPELINE_BUFFER_SIZE},
+      {0, 3 * IO_PIPELINE_BUFFER_SIZE + 1234, 0},
+  };
+  std::vector<unsigned char> expected(&data[IO_PIPELINE_BUFFER_SIZE], &data[0] + data.size());
+  expected.insert(expected.end(), data.begin(), data.begin() + IO_PIPELINE_BUFFER_SIZE);
+
+  // The same pipeline for every copy, the reader and buffers are reused
+  io::Pipeline pipeline;
+  for (uint32_t i = 0; i < 3; i++) {
+    std::string output_path = directory.get_path("output" + std::to_string(i));
+    io::FileDescriptor output_fd(open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)); // Flawfinder: ignore
+    uint64_t written = 0;
+    uint64_t callbacks = 0;
+    pipeline.copy(input_fd.get(), output_fd.get(), ranges, [&](uint64_t bytes) {
+      written += bytes;
+      callbacks++;
+    });
+    EXPECT_EQ(data.size(), written);
+    EXPECT_EQ(4, callbacks); // One per buffer sized piece
+    EXPECT_TRUE(fixtures::read_file(output_path) == expected); // Flawfinder: ignore
+  }
+
+  // Nothing to copy
+  pipeline.copy(input_fd.get(), -1, {});
+
+  // A failed read is rethrown on the writer and the pipeline is still usable afterwards
+  io::FileDescriptor output_fd(open(directory.get_path("failed").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)); // Flawfinder: ignore
+  EXPECT_EXCEPTION_REGEX(pipeline.copy(input_fd.get(), output_fd.get(), {{0, 0, data.size() + 1}}), "^Error: Error reading data! at \"io\\.cpp\":\\d*:\\(pread_all\\)$", "Copied past the end of the input");
+  EXPECT_EXCEPTION_REGEX(pipeline.copy(input_fd.get(), -1, {{0, 0, 100}}), "^Error: Error writing data! at \"io\\.cpp\":\\d*:\\(pwrite_all\\)$", "Wrote to an invalid descriptor");
+  pipeline.copy(input_fd.get(), output_fd.get(), {{0, 0, data.size()}});
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("failed")) == data); // Flawfinder: ignore
+}
+
+TEST(ioTests, copy) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = fixtures::random_data(IO_PIPELINE_BUFFER_SIZE + IO_COPY_BUFFER + 5, 5);
+  fixtures::write_file(directory.get_path("input"), data);
+  io::FileDescriptor input_fd(open(directory.get_path("input").c_str(), O_RDONLY)); // Flawfinder: ignore
+
+  // A slice of the input to an offset of the output, in every mode this platform has
+  std::vector<io::CopyMethod> methods = {io::CopyMethod::Auto, io::CopyMethod::ReadWrite, io::CopyMethod::Pipeline};
+#if defined(__linux__)
+  methods.push_back(io::CopyMethod::CopyFileRange);
+  methods.push_back(io::CopyMethod::Sendfile);
+#endif // __linux__
+  io::Pipeline pipeline;
+  for (auto &&method : methods) {
+    for (io::Pipeline *shared : {static_cast<io::Pipeline *>(nullptr), &pipeline}) {
+      std::string output_path = directory.get_path("output");
+      io::FileDescriptor output_fd(open(output_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)); // Flawfinder: ignore
+      std::vector<unsigned char> buffer;
+      io::copy(input_fd.get(), 100, output_fd.get(), 10, data.size() - 100, method, buffer, shared);
+
+      std::vector<unsigned char> expected(10, 0);
+      expected.insert(expected.end(), data.begin() + 100, data.end());
+      EXPECT_TRUE(fixtures::read_file(output_path) == expected) << "Method: " << static_cast<int>(method); // Flawfinder: ignore
+    }
+  }
+
+  // Nothing to copy
+  std::vector<unsigned char> buffer;
+  io::copy(input_fd.get(), 0, -1, 0, 0, io::CopyMethod::ReadWrite, buffer);
+}
+
+TEST(ioTests, hardlink) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = fixtures::random_data(100, 6);
+  fixtures::write_file(directory.get_path("source"), data);
+
+  // Replaces an existing target
+  fixtures::write_file(directory.get_path("target"), {1, 2, 3});
+  ASSERT_TRUE(io::hardlink(directory.get_path("source"), directory.get_path("target")));
+  EXPECT_TRUE(std::filesystem::equivalent(directory.get_path("source"), directory.get_path("target")));
+  EXPECT_EQ(2, std::filesystem::hard_link_count(directory.get_path("source")));
+
+  EXPECT_TRUE(io::hardlink(directory.get_path("source"), directory.get_path("new")));
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("new")) == data); // Flawfinder: ignore
+
+  EXPECT_FALSE(io::hardlink(directory.get_path("doesNotExist"), directory.get_path("other")));
+  EXPECT_FALSE(std::filesystem::exists(directory.get_path("other")));
+}
+
+TEST(ioTests, clone) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = fixtures::random_data(0x10000, 7);
+  fixtures::write_file(directory.get_path("source"), data);
+  io::FileDescriptor source_fd(open(directory.get_path("source").c_str(), O_RDONLY)); // Flawfinder: ignore
+  io::FileDescriptor target_fd(open(directory.get_path("target").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)); // Flawfinder: ignore
+
+  // Only some filesystems share blocks, a clone that succeeds must be a full copy
+  if (io::clone(source_fd.get(), target_fd.get())) {
+    EXPECT_TRUE(fixtures::read_file(directory.get_path("target")) == data); // Flawfinder: ignore
+  }
+  EXPECT_FALSE(io::clone(-1, target_fd.get()));
+}
+
+TEST(ioTests, copyFile) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = fixtures::random_data(12345, 8);
+  fixtures::write_file(directory.get_path("input"), data);
+
+  EXPECT_TRUE(io::copy_file(directory.get_path("input"), directory.get_path("output")));
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("output")) == data); // Flawfinder: ignore
+  EXPECT_TRUE(io::copy_file(directory.get_path("input"), directory.get_path("output"), io::CopyMethod::ReadWrite));
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("output")) == data); // Flawfinder: ignore
+
+  EXPECT_FALSE(io::copy_file(directory.get_path("doesNotExist"), directory.get_path("output")));
+  EXPECT_FALSE(io::copy_file(directory.get_path(), directory.get_path("output")));
+  EXPECT_FALSE(io::copy_file(directory.get_path("input"), directory.get_path("missing/output")));
+}
+
+#endif // DUMPER_TESTS_IO_TEST_H_
@@ -8,22 +8,817 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fixtures.h"
 #include "testing.h"
 
-TEST(pfsTests, parseDirectory) {
-  // TODO
+TEST(pfsTests, matchGlob) {
+  EXPECT_TRUE(pfs::match_glob("eboot.bin", "eboot.bin"));
+  EXPECT_FALSE(pfs::match_glob("eboot.bin", "eboot.bin2"));
+  EXPECT_TRUE(pfs::match_glob("*.sprx", "libc.sprx"));
+  EXPECT_FALSE(pfs::match_glob("*.sprx", "sce_module/libc.sprx")); // `*` does not cross directories
+  EXPECT_TRUE(pfs::match_glob("**/*.sprx", "sce_module/libc.sprx"));
+  EXPECT_TRUE(pfs::match_glob("**/*.sprx", "libc.sprx")); // `**/` matches no directories too
+  EXPECT_TRUE(pfs::match_glob("data/**", "data/a/b/c.bin"));
+  EXPECT_TRUE(pfs::match_glob("s0?", "s01"));
+  EXPECT_FALSE(pfs::match_glob("s0?", "s0/"));
+  EXPECT_TRUE(pfs::match_glob("s[0-2]", "s1"));
+  EXPECT_FALSE(pfs::match_glob("s[!0-2]", "s1"));
+  EXPECT_TRUE(pfs::match_glob("s[!0-2]", "s3"));
+  EXPECT_TRUE(pfs::match_glob("a\\*", "a*"));
+  EXPECT_FALSE(pfs::match_glob("a\\*", "ab"));
+}
+
+TEST(pfsTests, pathFilter) {
+  pfs::PathFilter everything;
+  EXPECT_TRUE(everything.is_empty());
+  EXPECT_TRUE(everything.is_included("a/b"));
+  EXPECT_FALSE(everything.is_excluded("a/b"));
+
+  pfs::PathFilter filter({"sce_sys/", "eboot.bin", "**/*.sprx", "data/*/x.txt"}, {"sce_sys/trophy"});
+  EXPECT_FALSE(filter.is_empty());
+  EXPECT_TRUE(filter.is_included("sce_sys"));
+  EXPECT_TRUE(filter.is_included("sce_sys/param.sfo")); // Below an included directory
+  EXPECT_FALSE(filter.is_included("data/sce_sys/param.sfo")); // Anchored at the root
+  EXPECT_TRUE(filter.is_included("eboot.bin"));
+  EXPECT_FALSE(filter.is_included("data/eboot.bin"));
+  EXPECT_TRUE(filter.is_included("sce_module/libc.sprx")); // `**` reaches any depth
+  EXPECT_TRUE(filter.is_included("libc.sprx"));
+  EXPECT_TRUE(filter.is_included("data/sub/x.txt"));
+  EXPECT_FALSE(filter.is_included("data/x.txt"));
+  EXPECT_TRUE(filter.is_excluded("sce_sys/trophy/trophy00.trp"));
+  EXPECT_FALSE(filter.is_excluded("sce_sys/param.sfo"));
+
+  // Only directories a pattern can reach are walked
+  pfs::PathFilter rooted({"data/*/x.txt"}, {});
+  EXPECT_TRUE(rooted.may_contain("data"));
+  EXPECT_TRUE(rooted.may_contain("data/sub"));
+  EXPECT_FALSE(rooted.may_contain("sce_sys"));
+  pfs::PathFilter names({"sce_sys/", "eboot.bin"}, {});
+  EXPECT_FALSE(names.may_contain("data"));
+  EXPECT_FALSE(names.may_contain("sce_module"));
+  EXPECT_TRUE(names.may_contain("sce_sys"));
+  pfs::PathFilter anywhere({"**/*.sprx"}, {});
+  EXPECT_TRUE(anywhere.may_contain("data/sub"));
+}
+
+// 12 direct, a full single indirect block and a few blocks through the double indirect block
+#define PFS_TEST_BIG_SIZE ((PFS_DIRECT_BLOCKS + 0x400 + 5) * 0x1000 + 123)
+
+static std::map<std::string, std::vector<unsigned char>> pfs_test_files() {
+  std::map<std::string, std::vector<unsigned char>> files;
+  files["eboot.bin"] = fixtures::random_data(5000, 1);
+  files["sce_sys/param.sfo"] = fixtures::random_data(100, 2);
+  files["sce_sys/icon0.png"] = fixtures::random_data(3 * 0x1000, 3);
+  files["data/big.bin"] = fixtures::random_data(PFS_TEST_BIG_SIZE, 4);
+  files["data/empty"] = std::vector<unsigned char>();
+  files["data/zero.bin"] = std::vector<unsigned char>(5 * 0x1000, 0);
+  files["data/zero.bin"].push_back('x');
+  files["data/sub/x.txt"] = {'h', 'e', 'l', 'l', 'o'};
+  return files;
+}
+
+// The files above plus "data/link.bin", a second directory entry for the inode of eboot.bin
+static std::string pfs_test_image(const fixtures::TemporaryDirectory &directory, bool fragmented = false) {
+  fixtures::PfsBuilder builder;
+  builder.set_fragmented(fragmented);
+  for (auto &&file : pfs_test_files()) {
+    builder.add_file(file.first, file.second);
+  }
+  builder.add_directory("data/nothing");
+  builder.add_link("data/link.bin", "eboot.bin");
+
+  std::string image_path = directory.get_path(fragmented ? "fragmented.dat" : "image.dat");
+  builder.write(image_path);
+  return image_path;
+}
+
+// Every regular file below `output_path` must be listed in `expected` with the same contents, and the other way around
+static void pfs_test_compare(const std::string &output_path, std::map<std::string, std::vector<unsigned char>> expected) {
+  for (auto &&file : std::filesystem::recursive_directory_iterator(output_path)) {
+    if (!file.is_regular_file()) {
+      continue;
+    }
+    std::string relative = std::filesystem::relative(file.path(), output_path).string();
+    auto match = expected.find(relative);
+    if (match == expected.end()) {
+      ADD_FAILURE() << "Unexpected file: " << relative;
+      continue;
+    }
+    EXPECT_TRUE(fixtures::read_file(file.path()) == match->second) << "Contents differ: " << relative;
+    expected.erase(match);
+  }
+  for (auto &&missing : expected) {
+    ADD_FAILURE() << "Missing file: " << missing.first;
+  }
+}
+
+// Records of a journal in file order, as path and the raw record bytes
+static std::vector<std::pair<std::string, std::vector<unsigned char>>> pfs_test_journal_records(const std::vector<unsigned char> &journal) {
+  std::vector<std::pair<std::string, std::vector<unsigned char>>> records;
+  size_t offset = sizeof(pfs::journal_header);
+  while (offset + sizeof(pfs::journal_record) <= journal.size()) {
+    pfs::journal_record record;
+    std::memcpy(&record, &journal[offset], sizeof(record));
+    size_t record_size = sizeof(record) + record.path_size;
+    records.push_back({std::string(reinterpret_cast<const char *>(&journal[offset + sizeof(record)]), record.path_size), std::vector<unsigned char>(journal.begin() + offset, journal.begin() + offset + record_size)});
+    offset += record_size;
+  }
+  return records;
+}
+
+TEST(pfsTests, journal) {
+  fixtures::TemporaryDirectory directory;
+  std::string journal_path = directory.get_path("journal");
+  pfs::pfs_header header;
+  std::memset(&header, 0, sizeof(header));
+  header.blocksz = 0x1000;
+  header.ndinode = 10;
+  unsigned char crc[4] = {1, 2, 3, 4};
+
+  {
+    pfs::Journal journal;
+    EXPECT_FALSE(journal.is_open());
+    journal.open(journal_path, header, false);
+    EXPECT_TRUE(journal.is_open());
+    journal.append("a/first", 100, nullptr);
+    journal.append("a/second", 200, crc);
+    journal.append("third", 300, nullptr);
+    EXPECT_EQ(nullptr, journal.find("a/first")); // Only records read back when resuming are looked up
+    EXPECT_EXCEPTION_REGEX(journal.append("", 0, nullptr), "^Error: Path cannot be journaled: .*", "Journaled an empty path");
+  }
+
+  // Cut the last record short, as a crash in the middle of the append would
+  std::vector<unsigned char> data = fixtures::read_file(journal_path); // Flawfinder: ignore
+  data.resize(data.size() - 3);
+  fixtures::write_file(journal_path, data);
+
+  pfs::Journal journal;
+  journal.open(journal_path, header, true);
+  ASSERT_NE(nullptr, journal.find("a/first"));
+  EXPECT_EQ(100, journal.find("a/first")->size);
+  EXPECT_EQ(0, journal.find("a/first")->flags & PFS_JOURNAL_CRC);
+  ASSERT_NE(nullptr, journal.find("a/second"));
+  EXPECT_EQ(PFS_JOURNAL_CRC, journal.find("a/second")->flags & PFS_JOURNAL_CRC);
+  EXPECT_EQ(0, std::memcmp(crc, journal.find("a/second")->crc, sizeof(crc)));
+  EXPECT_EQ(nullptr, journal.find("third"));
+
+  // The torn record is dropped from the file as well, the next append follows the last intact one
+  journal.append("fourth", 400, nullptr);
+  journal.close();
+  journal.open(journal_path, header, true);
+  EXPECT_NE(nullptr, journal.find("fourth"));
+  EXPECT_EQ(nullptr, journal.find("third"));
+
+  // A bit flip in a record's path invalidates it and everything after it
+  journal.close();
+  data = fixtures::read_file(journal_path); // Flawfinder: ignore
+  data[sizeof(pfs::journal_header) + sizeof(pfs::journal_record) + 1] ^= 1;
+  fixtures::write_file(journal_path, data);
+  journal.open(journal_path, header, true);
+  EXPECT_EQ(nullptr, journal.find("a/first"));
+  EXPECT_EQ(nullptr, journal.find("fourth"));
+
+  // Not resuming starts over
+  journal.close();
+  journal.open(journal_path, header, false);
+  EXPECT_EQ(sizeof(pfs::journal_header), std::filesystem::file_size(journal_path));
+
+  // Deferred records only reach the file once their batch has been synced
+  journal.close();
+  journal.open(journal_path, header, false);
+  EXPECT_EQ(1, journal.defer("first", 10));
+  EXPECT_EQ(2, journal.defer("second", 20));
+  EXPECT_EQ(sizeof(pfs::journal_header), std::filesystem::file_size(journal_path));
+  std::vector<std::string> synced;
+  journal.commit([&](const std::vector<std::string> &paths) {
+    EXPECT_EQ(sizeof(pfs::journal_header), std::filesystem::file_size(journal_path));
+    synced = paths;
+  });
+  EXPECT_EQ(std::vector<std::string>({"first", "second"}), synced);
+  EXPECT_EQ(2, pfs_test_journal_records(fixtures::read_file(journal_path)).size()); // Flawfinder: ignore
+  journal.commit([&](const std::vector<std::string> &) { ADD_FAILURE() << "Synced an empty batch"; });
+
+  // A failed sync writes none of the records
+  journal.defer("third", 30);
+  EXPECT_ANY_THROW(journal.commit([](const std::vector<std::string> &) { FATAL_ERROR("Sync failed"); }));
+  EXPECT_EQ(2, pfs_test_journal_records(fixtures::read_file(journal_path)).size()); // Flawfinder: ignore
+
+  // A journal of another image is never used
+  journal.close();
+  header.ndinode++;
+  EXPECT_EXCEPTION_REGEX(journal.open(journal_path, header, true), "^Error: Journal does not belong to this PFS image: .* at \"pfs\\.cpp\":\\d*:\\(open\\)$", "Resumed from the journal of another image");
+  EXPECT_FALSE(journal.is_open());
+}
+
+TEST(pfsTests, resume) {
+  fixtures::TemporaryDirectory directory;
+  std::string image_path = pfs_test_image(directory);
+  std::map<std::string, std::vector<unsigned char>> expected = pfs_test_files();
+  expected["data/link.bin"] = expected["eboot.bin"];
+
+  for (bool link_duplicates : {false, true}) {
+    for (bool journal_crc : {false, true}) {
+      std::string output_path = directory.get_path("output");
+      std::string journal_path = directory.get_path("journal");
+      std::filesystem::remove_all(output_path);
+
+      pfs::extract_options options;
+      options.journal_path = journal_path;
+      options.journal_crc = journal_crc;
+      options.link_duplicates = link_duplicates;
+      options.worker_count = 2;
+      pfs::Image image(image_path);
+      image.dump(output_path, options);
+      pfs_test_compare(output_path, expected);
+
+      // Interrupt: two files never made it into the journal and were left preallocated, the append of a third was torn
+      // data/link.bin has no record of its own either, so it cannot be trusted just because eboot.bin is complete
+      std::vector<unsigned char> journal = fixtures::read_file(journal_path); // Flawfinder: ignore
+      std::vector<unsigned char> interrupted(journal.begin(), journal.begin() + sizeof(pfs::journal_header));
+      std::vector<unsigned char> torn;
+      for (auto &&record : pfs_test_journal_records(journal)) {
+        if (record.first == "data/big.bin" || record.first == "data/link.bin") {
+          continue;
+        }
+        if (record.first == "sce_sys/icon0.png") {
+          torn = record.second;
+          continue;
+        }
+        interrupted.insert(interrupted.end(), record.second.begin(), record.second.end());
+      }
+      ASSERT_FALSE(torn.empty());
+      interrupted.insert(interrupted.end(), torn.begin(), torn.end() - 1);
+      fixtures::write_file(journal_path, interrupted);
+      for (auto &&lost : {"data/big.bin", "data/link.bin", "sce_sys/icon0.png"}) {
+        std::filesystem::remove(output_path + "/" + lost);
+        fixtures::write_file(output_path + "/" + lost, std::vector<unsigned char>(expected[lost].size(), 0));
+      }
+
+      // Same size, different bytes, only caught when the journal stores CRCs
+      std::vector<unsigned char> changed = expected["sce_sys/param.sfo"];
+      changed[0] ^= 0xFF;
+      fixtures::write_file(output_path + "/sce_sys/param.sfo", changed);
+
+      options.resume = true;
+      pfs::Image resumed(image_path);
+      resumed.dump(output_path, options);
+
+      std::map<std::string, std::vector<unsigned char>> result = expected;
+      if (!journal_crc) {
+        result["sce_sys/param.sfo"] = changed; // Trusted, it was flushed before its record was written
+      }
+      pfs_test_compare(output_path, result);
+
+      // Every file is journaled again, a recopied file may be listed twice
+      std::set<std::string> journaled;
+      for (auto &&record : pfs_test_journal_records(fixtures::read_file(journal_path))) { // Flawfinder: ignore
+        journaled.insert(record.first);
+      }
+      EXPECT_EQ(result.size(), journaled.size());
+    }
+  }
+}
+
+TEST(pfsTests, image) {
+  fixtures::TemporaryDirectory directory;
+  std::string image_path = pfs_test_image(directory);
+
+  // Empty input arguments
+  EXPECT_EXCEPTION_REGEX(pfs::Image image(""), "^Error: Empty input path argument! at \"pfs\\.cpp\":\\d*:\\(Image\\)$", "Accepted empty argument");
+  EXPECT_EXCEPTION_REGEX(pfs::Image image(" \t"), "^Error: Empty input path argument! at \"pfs\\.cpp\":\\d*:\\(Image\\)$", "Accepted whitespace argument");
+
+  // Non-existant file or non-file object
+  EXPECT_EXCEPTION_REGEX(pfs::Image image(directory.get_path("doesNotExist.dat")), "^Error: Input path does not exist or is not a file! at \"pfs\\.cpp\":\\d*:\\(Image\\)$", "Opened non-existant file");
+  EXPECT_EXCEPTION_REGEX(pfs::Image image(directory.get_path()), "^Error: Input path does not exist or is not a file! at \"pfs\\.cpp\":\\d*:\\(Image\\)$", "Opened non-file object as file");
+
+  // Not a PFS image
+  fixtures::write_file(directory.get_path("notPfs.dat"), std::vector<unsigned char>(0x1000, 0));
+  EXPECT_EXCEPTION_REGEX(pfs::Image image(directory.get_path("notPfs.dat")), "^Error: File magic does not match pfs_image\\.dat! Expected: 0x0B2A330100000000 \\| Actual: 0x0000000000000000 at \"pfs\\.cpp\":\\d*:\\(Image\\)$", "Opened a file that is not a PFS image");
+
+  // Embedded range that runs past the end of the file
+  EXPECT_EXCEPTION_REGEX(pfs::Image image(image_path, false, 0x1000, std::filesystem::file_size(image_path)), "^Error: Image range is outside of the file! at \"pfs\\.cpp\":\\d*:\\(Image\\)$", "Accepted an image range past the end of the file");
+
+  // Inode table larger than the image, rejected before anything is allocated for it
+  std::vector<unsigned char> oversized = fixtures::read_file(image_path);
+  uint64_t huge = 1ULL << 40;
+  std::memcpy(&oversized[offsetof(pfs::pfs_header, ndinode)], &huge, sizeof(huge));
+  std::memcpy(&oversized[offsetof(pfs::pfs_header, ndinodeblock)], &huge, sizeof(huge));
+  fixtures::write_file(directory.get_path("oversized.dat"), oversized);
+  for (bool memory_map : {false, true}) {
+    EXPECT_EXCEPTION_REGEX(pfs::Image image(directory.get_path("oversized.dat"), memory_map), "^Error: Error reading inodes! at \"pfs\\.cpp\":\\d*:\\(Image\\)$", "Accepted an inode table past the end of the image");
+  }
+
+  for (bool memory_map : {false, true}) {
+    pfs::Image image(image_path, memory_map);
+    EXPECT_EQ(memory_map, image.is_memory_mapped());
+    EXPECT_EQ(0x1000, image.get_header().blocksz);
+    EXPECT_EQ(0, image.get_header().superroot_ino);
+    EXPECT_EQ(image.get_header().ndinode, image.get_inode_count());
+  }
+}
+
+TEST(pfsTests, getInode) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+  const pfs::manifest_entry *eboot = image.find("eboot.bin");
+  ASSERT_NE(nullptr, eboot);
+
+  pfs::di_d32 inode = image.get_inode(eboot->ino);
+  EXPECT_EQ(0x8000, inode.mode);
+  EXPECT_EQ(5000, inode.size);
+  EXPECT_EQ(2, inode.blocks);
+  EXPECT_EQ(inode.mode, image.get_mode(eboot->ino));
+  EXPECT_EQ(inode.size, image.get_size(eboot->ino));
+  EXPECT_EQ(0, image.get_flags(eboot->ino));
+  EXPECT_EQ(0x4000, image.get_mode(image.find("data")->ino));
+
+  EXPECT_EXCEPTION_REGEX(image.get_inode(image.get_inode_count()), "^Error: Inode index out of range! at \"pfs\\.cpp\":\\d*:\\(get_inode_offset\\)$", "Read an inode past the end of the table");
+}
+
+TEST(pfsTests, getBlockMap) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+  const pfs::manifest_entry *big = image.find("data/big.bin");
+  ASSERT_NE(nullptr, big);
+
+  Span<const uint32_t> map = image.get_block_map(big->ino);
+  EXPECT_EQ(PFS_BLOCK_MAP_SIZE, map.size());
+  for (uint32_t i = 1; i < PFS_DIRECT_BLOCKS; i++) {
+    EXPECT_EQ(map[0] + i, map[i]);
+  }
+  EXPECT_NE(0, map[PFS_DIRECT_BLOCKS]);     // Single indirect
+  EXPECT_NE(0, map[PFS_DIRECT_BLOCKS + 1]); // Double indirect
+  EXPECT_EQ(0, map[PFS_DIRECT_BLOCKS + 2]);
+  EXPECT_EQ(big->first_block, map[0]);
+}
+
+TEST(pfsTests, getInodeBlock) {
+  fixtures::TemporaryDirectory directory;
+  std::string image_path = pfs_test_image(directory);
+
+  pfs::Image unmapped(image_path);
+  EXPECT_EXCEPTION_REGEX(unmapped.get_inode_block(0), "^Error: Image is not memory mapped! at \"pfs\\.cpp\":\\d*:\\(get_inode_block\\)$", "Returned a view without a mapping");
+
+  pfs::Image image(image_path, true);
+  Span<const pfs::di_d32> block = image.get_inode_block(0);
+  EXPECT_EQ(image.get_inode_count(), block.size()); // Every inode of the test image fits in the first block
+  EXPECT_EQ(0x4000, block[0].mode);                 // Superroot
+  EXPECT_EQ(image.get_size(3), block[3].size);
+  EXPECT_EXCEPTION_REGEX(image.get_inode_block(1), "^Error: Inode block index out of range! at \"pfs\\.cpp\":\\d*:\\(get_inode_block\\)$", "Returned an inode block past the table");
+}
+
+TEST(pfsTests, getBlock) {
+  fixtures::TemporaryDirectory directory;
+  std::string image_path = pfs_test_image(directory);
+
+  pfs::Image unmapped(image_path);
+  EXPECT_EXCEPTION_REGEX(unmapped.get_block(0), "^Error: Image is not memory mapped! at \"pfs\\.cpp\":\\d*:\\(get_block\\)$", "Returned a view without a mapping");
+
+  pfs::Image image(image_path, true);
+  const pfs::manifest_entry *eboot = image.find("eboot.bin");
+  ASSERT_NE(nullptr, eboot);
+  std::vector<unsigned char> expected = pfs_test_files()["eboot.bin"];
+  Span<const unsigned char> block = image.get_block(eboot->first_block);
+  EXPECT_EQ(0x1000, block.size());
+  EXPECT_EQ(0, std::memcmp(block.data(), expected.data(), block.size()));
+}
+
+TEST(pfsTests, getExtents) {
+  fixtures::TemporaryDirectory directory;
+  uint64_t big_blocks = (PFS_TEST_BIG_SIZE + 0xFFF) / 0x1000;
+
+  // Contiguous blocks, direct and indirect alike, merge into one run
+  pfs::Image image(pfs_test_image(directory));
+  const pfs::manifest_entry *big = image.find("data/big.bin");
+  ASSERT_NE(nullptr, big);
+  std::vector<pfs::extent> extents = image.get_extents(big->ino);
+  ASSERT_EQ(1, extents.size());
+  EXPECT_EQ(big->first_block, extents[0].block);
+  EXPECT_EQ(big_blocks, extents[0].count);
+  EXPECT_EQ(1, big->extent_count);
+
+  // Every other block, every block is its own run and the indirect blocks have to be followed for all of them
+  pfs::Image fragmented(pfs_test_image(directory, true));
+  big = fragmented.find("data/big.bin");
+  ASSERT_NE(nullptr, big);
+  extents = fragmented.get_extents(big->ino);
+  ASSERT_EQ(big_blocks, extents.size());
+  for (uint64_t i = 0; i < extents.size(); i++) {
+    EXPECT_EQ(big->first_block + 2 * i, extents[i].block);
+    EXPECT_EQ(1, extents[i].count);
+  }
+}
+
+TEST(pfsTests, read) {
+  fixtures::TemporaryDirectory directory;
+  std::string image_path = pfs_test_image(directory);
+  uint64_t image_size = std::filesystem::file_size(image_path);
+
+  for (bool memory_map : {false, true}) {
+    pfs::Image image(image_path, memory_map);
+    pfs::pfs_header header;
+    image.read(&header, sizeof(header), 0); // Flawfinder: ignore
+    EXPECT_EQ(PFS_MAGIC, __builtin_bswap64(header.magic));
+
+    unsigned char byte;
+    EXPECT_ANY_THROW(image.read(&byte, 1, image_size)); // Flawfinder: ignore
+  }
+
+  // An image embedded in a larger file is read relative to its start
+  std::vector<unsigned char> wrapped(0x3000, 0xAA);
+  std::vector<unsigned char> data = fixtures::read_file(image_path); // Flawfinder: ignore
+  wrapped.insert(wrapped.end(), data.begin(), data.end());
+  wrapped.resize(wrapped.size() + 0x100, 0xBB);
+  fixtures::write_file(directory.get_path("wrapped.dat"), wrapped);
+  pfs::Image embedded(directory.get_path("wrapped.dat"), false, 0x3000, data.size());
+  unsigned char byte;
+  EXPECT_ANY_THROW(embedded.read(&byte, 1, data.size())); // Flawfinder: ignore
+  EXPECT_EQ(pfs_test_files().size() + 1, embedded.build_manifest().file_count);
 }
 
-TEST(pfsTests, calculatePfsSize) {
-  // TODO
+TEST(pfsTests, buildManifest) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+  std::map<std::string, std::vector<unsigned char>> files = pfs_test_files();
+
+  const pfs::manifest &listing = image.build_manifest();
+  uint64_t total_size = files["eboot.bin"].size(); // data/link.bin
+  for (auto &&file : files) {
+    total_size += file.second.size();
+  }
+  EXPECT_EQ(files.size() + 1, listing.file_count);
+  EXPECT_EQ(total_size, listing.total_size);
+
+  std::map<std::string, uint32_t> types;
+  for (auto &&entry : listing.entries) {
+    types[image.get_path(entry)] = entry.type;
+  }
+  EXPECT_EQ(3, types["data"]);
+  EXPECT_EQ(3, types["data/nothing"]);
+  EXPECT_EQ(3, types["sce_sys"]);
+  EXPECT_EQ(2, types["data/sub/x.txt"]);
+  EXPECT_EQ(2, types["data/link.bin"]);
+  EXPECT_EQ(0, types.count("uroot")); // The superroot is not part of the output tree
+  EXPECT_EQ(0, types.count("flat_path_table"));
+
+  // A filtered listing keeps the parents of what it selects and nothing else
+  const pfs::manifest &filtered = image.build_manifest(pfs::PathFilter({"**/*.txt"}, {}));
+  EXPECT_EQ(1, filtered.file_count);
+  EXPECT_EQ(5, filtered.total_size);
+  std::vector<std::string> paths;
+  for (auto &&entry : filtered.entries) {
+    paths.push_back(image.get_path(entry));
+  }
+  EXPECT_EQ(std::vector<std::string>({"data", "data/sub", "data/sub/x.txt"}), paths);
+
+  EXPECT_EQ(total_size, image.calculate_size()); // Back to the full listing
 }
 
-TEST(pfsTests, dumpPfs) {
-  //TODO
+TEST(pfsTests, loadIndex) {
+  fixtures::TemporaryDirectory directory;
+  std::string image_path = pfs_test_image(directory);
+  std::string index_path = directory.get_path("image.pfsidx");
+
+  pfs::Image missing(image_path);
+  EXPECT_FALSE(missing.load_index(index_path));
+
+  std::vector<std::string> expected;
+  {
+    pfs::Image image(image_path);
+    for (auto &&entry : image.build_manifest().entries) {
+      expected.push_back(image.get_path(entry));
+    }
+    image.save_index(index_path);
+  }
+
+  pfs::Image image(image_path);
+  ASSERT_TRUE(image.load_index(index_path));
+  std::vector<std::string> loaded;
+  for (auto &&entry : image.build_manifest().entries) {
+    loaded.push_back(image.get_path(entry));
+  }
+  EXPECT_EQ(expected, loaded);
+  EXPECT_EQ(PFS_TEST_BIG_SIZE, image.find("data/big.bin")->size);
+
+  // An index of another image is stale
+  pfs::Image other(pfs_test_image(directory, true));
+  EXPECT_FALSE(other.load_index(index_path));
+
+  // Paths that would leave the output directory
+  std::vector<unsigned char> index = fixtures::read_file(index_path); // Flawfinder: ignore
+  std::string name("eboot.bin", sizeof("eboot.bin"));
+  size_t name_offset = std::search(index.begin(), index.end(), name.begin(), name.end()) - index.begin();
+  ASSERT_LT(name_offset, index.size());
+  for (std::string unsafe : {"/boot.bin", "../ot.bin", "./eot.bin", "a//ot.bin", "eboot/../"}) {
+    std::vector<unsigned char> escaping = index;
+    std::copy(unsafe.begin(), unsafe.end(), escaping.begin() + name_offset);
+    fixtures::write_file(index_path, escaping);
+    pfs::Image escaped(image_path);
+    EXPECT_FALSE(escaped.load_index(index_path)) << unsafe;
+  }
+
+  // A path offset pointing out of the path table is damage, not something to follow
+  pfs::index_header header;
+  std::memcpy(&header, index.data(), sizeof(header));
+  pfs::manifest_entry first;
+  std::memcpy(&first, &index[(sizeof(header) + 7) & ~7], sizeof(first));
+  first.path_offset = header.paths_size;
+  std::memcpy(&index[(sizeof(header) + 7) & ~7], &first, sizeof(first));
+  fixtures::write_file(index_path, index);
+  pfs::Image damaged(image_path);
+  EXPECT_FALSE(damaged.load_index(index_path));
+
+  fixtures::write_file(index_path, std::vector<unsigned char>(10, 0));
+  EXPECT_FALSE(damaged.load_index(index_path));
+}
+
+TEST(pfsTests, saveIndex) {
+  fixtures::TemporaryDirectory directory;
+  std::string image_path = pfs_test_image(directory);
+  std::string index_path = directory.get_path("image.pfsidx");
+
+  // Written on the first dump, loaded on the next one
+  pfs::extract_options options;
+  options.index_path = index_path;
+  pfs::Image image(image_path);
+  image.dump(directory.get_path("first"), options);
+  EXPECT_TRUE(std::filesystem::is_regular_file(index_path));
+  EXPECT_FALSE(std::filesystem::exists(index_path + ".tmp"));
+
+  pfs::Image again(image_path);
+  again.dump(directory.get_path("second"), options);
+  pfs_test_compare(directory.get_path("second"), [&]() {
+    std::map<std::string, std::vector<unsigned char>> files = pfs_test_files();
+    files["data/link.bin"] = files["eboot.bin"];
+    return files;
+  }());
+}
+
+TEST(pfsTests, getPath) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+  const pfs::manifest_entry *entry = image.find("sce_sys/icon0.png");
+  ASSERT_NE(nullptr, entry);
+  EXPECT_STREQ("sce_sys/icon0.png", image.get_path(*entry));
+}
+
+TEST(pfsTests, readFile) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> expected = pfs_test_files()["data/big.bin"];
+
+  for (bool fragmented : {false, true}) {
+    pfs::Image image(pfs_test_image(directory, fragmented));
+    const pfs::manifest_entry *big = image.find("data/big.bin");
+    ASSERT_NE(nullptr, big);
+
+    // Across block, direct/indirect and extent boundaries
+    for (uint64_t offset : {0UL, 0xFFFUL, 0xBFF0UL, 0x40C000UL - 7, static_cast<uint64_t>(PFS_TEST_BIG_SIZE) - 0x2000}) {
+      std::vector<unsigned char> buffer(0x1800);
+      image.read_file(*big, buffer.data(), buffer.size(), offset); // Flawfinder: ignore
+      EXPECT_EQ(0, std::memcmp(buffer.data(), &expected[offset], buffer.size())) << "Offset: " << offset;
+    }
+  }
+}
+
+TEST(pfsTests, find) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+
+  const pfs::manifest_entry *entry = image.find("/eboot.bin");
+  ASSERT_NE(nullptr, entry);
+  EXPECT_EQ(5000, entry->size);
+  EXPECT_EQ(entry->ino, image.find("data/link.bin")->ino);
+
+  entry = image.find("sce_sys/");
+  ASSERT_NE(nullptr, entry);
+  EXPECT_EQ(3, entry->type);
+
+  EXPECT_EQ(nullptr, image.find("doesNotExist"));
+  EXPECT_EQ(nullptr, image.find("sce_sys/param"));
+}
+
+TEST(pfsTests, open) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+
+  EXPECT_EXCEPTION_REGEX(image.open("doesNotExist"), "^Error: File does not exist in PFS image: doesNotExist at \"pfs\\.cpp\":\\d*:\\(open\\)$", "Opened a missing file");
+  EXPECT_EXCEPTION_REGEX(image.open("sce_sys"), "^Error: Path is not a file: sce_sys at \"pfs\\.cpp\":\\d*:\\(open\\)$", "Opened a directory as a file");
+
+  pfs::File file = image.open("sce_sys/param.sfo");
+  EXPECT_EQ(100, file.get_size());
+}
+
+TEST(pfsTests, file) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> expected = pfs_test_files()["data/big.bin"];
+  pfs::Image image(pfs_test_image(directory, true));
+  pfs::File file = image.open("data/big.bin");
+  EXPECT_EQ(expected.size(), file.get_size());
+
+  // Sequential reads pick up where the last one stopped
+  std::vector<unsigned char> buffer(0x1234);
+  EXPECT_EQ(buffer.size(), file.read(buffer.data(), buffer.size())); // Flawfinder: ignore
+  EXPECT_EQ(0, std::memcmp(buffer.data(), &expected[0], buffer.size()));
+  EXPECT_EQ(buffer.size(), file.read(buffer.data(), buffer.size())); // Flawfinder: ignore
+  EXPECT_EQ(0, std::memcmp(buffer.data(), &expected[0x1234], buffer.size()));
+  EXPECT_EQ(2 * buffer.size(), file.tell());
+
+  // Short only at the end of the file
+  file.seek(expected.size() - 10);
+  EXPECT_EQ(10, file.read(buffer.data(), buffer.size())); // Flawfinder: ignore
+  EXPECT_EQ(0, std::memcmp(buffer.data(), &expected[expected.size() - 10], 10));
+  EXPECT_EQ(0, file.read(buffer.data(), buffer.size())); // Flawfinder: ignore
+  EXPECT_EQ(0, file.pread(buffer.data(), buffer.size(), expected.size() + 1));
+
+  // Positioned reads leave the position alone
+  EXPECT_EQ(buffer.size(), file.pread(buffer.data(), buffer.size(), 0x40C000));
+  EXPECT_EQ(0, std::memcmp(buffer.data(), &expected[0x40C000], buffer.size()));
+  EXPECT_EQ(expected.size(), file.tell());
+}
+
+TEST(pfsTests, calculateSize) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+  uint64_t total_size = 5000; // data/link.bin
+  for (auto &&file : pfs_test_files()) {
+    total_size += file.second.size();
+  }
+  EXPECT_EQ(total_size, image.calculate_size());
+}
+
+TEST(pfsTests, getDeduplicated) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+
+  pfs::extract_options options;
+  image.dump(directory.get_path("copied"), options);
+  EXPECT_EQ(0, image.get_deduplicated());
+
+  options.link_duplicates = true;
+  image.dump(directory.get_path("linked"), options);
+  EXPECT_EQ(5000, image.get_deduplicated());
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("linked/data/link.bin")) == pfs_test_files()["eboot.bin"]); // Flawfinder: ignore
+
+  // Separate inodes with the same bytes are only found by content
+  fixtures::PfsBuilder builder;
+  std::vector<unsigned char> data = fixtures::random_data(3000, 7);
+  builder.add_file("a.bin", data);
+  builder.add_file("sub/b.bin", data);
+  builder.add_file("c.bin", fixtures::random_data(3000, 8)); // Same size, other bytes
+  std::string hashed_path = directory.get_path("hashed.dat");
+  fixtures::write_file(hashed_path, builder.build());
+
+  pfs::Image hashed(hashed_path);
+  pfs::extract_options hash_options;
+  hash_options.hash_duplicates = true;
+  hashed.dump(directory.get_path("hashed"), hash_options);
+  EXPECT_EQ(data.size(), hashed.get_deduplicated());
+  EXPECT_TRUE(std::filesystem::equivalent(directory.get_path("hashed/a.bin"), directory.get_path("hashed/sub/b.bin")));
+  EXPECT_FALSE(std::filesystem::equivalent(directory.get_path("hashed/a.bin"), directory.get_path("hashed/c.bin")));
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("hashed/sub/b.bin")) == data); // Flawfinder: ignore
+}
+
+TEST(pfsTests, getProgress) {
+  fixtures::TemporaryDirectory directory;
+  pfs::Image image(pfs_test_image(directory));
+
+  uint64_t callbacks = 0;
+  progress::snapshot last;
+  pfs::extract_options options;
+  options.on_progress = [&](const progress::snapshot &state) {
+    callbacks++;
+    last = state;
+  };
+  image.dump(directory.get_path("output"), options);
+
+  EXPECT_GE(callbacks, 1); // At least the final one
+  EXPECT_EQ(image.calculate_size(), last.bytes_total);
+  EXPECT_EQ(last.bytes_total, last.bytes_done);
+  EXPECT_EQ(last.files_total, last.files_done);
+  EXPECT_EQ(last.bytes_done, image.get_progress().bytes_done);
+  EXPECT_EQ(last.bytes_done, image.get_copied());
+
+  // A filtered dump followed by a full listing leaves the last file name intact
+  options.include_paths = {"sce_sys"};
+  image.dump(directory.get_path("filtered"), options);
+  image.calculate_size();
+  EXPECT_FALSE(image.get_progress().current_file.empty());
+}
+
+TEST(pfsTests, dump) {
+  fixtures::TemporaryDirectory directory;
+  std::map<std::string, std::vector<unsigned char>> expected = pfs_test_files();
+  expected["data/link.bin"] = expected["eboot.bin"];
+
+  // Byte identical output whatever path the data takes
+  uint32_t run = 0;
+  for (bool fragmented : {false, true}) {
+    std::string image_path = pfs_test_image(directory, fragmented);
+    for (bool memory_map : {false, true}) {
+      for (io::CopyMethod method : {io::CopyMethod::Auto, io::CopyMethod::ReadWrite, io::CopyMethod::Pipeline}) {
+        for (uint32_t workers : {1, 4}) {
+          pfs::extract_options options;
+          options.memory_map = memory_map;
+          options.copy_method = method;
+          options.worker_count = workers;
+          options.physical_order = workers > 1;
+          options.sparse = run % 3 == 1;
+          options.preallocate = run % 3 == 2;
+          options.small_file_size = run % 2 == 0 ? PFS_SMALL_FILE_SIZE : 0;
+          std::string output_path = directory.get_path("output" + std::to_string(run++));
+
+          pfs::Image image(image_path, memory_map);
+          image.dump(output_path, options);
+          pfs_test_compare(output_path, expected);
+          EXPECT_TRUE(std::filesystem::is_directory(output_path + "/data/nothing"));
+        }
+      }
+    }
+  }
+
+  // Filters, an excluded directory is never created
+  pfs::extract_options options;
+  options.include_paths = {"sce_sys", "**/*.txt"};
+  options.exclude_paths = {"**/icon0.png"};
+  pfs::Image image(pfs_test_image(directory));
+  image.dump(directory.get_path("filtered"), options);
+  pfs_test_compare(directory.get_path("filtered"), {{"sce_sys/param.sfo", expected["sce_sys/param.sfo"]}, {"data/sub/x.txt", expected["data/sub/x.txt"]}});
+  EXPECT_FALSE(std::filesystem::exists(directory.get_path("filtered/data/nothing")));
+}
+
+TEST(pfsTests, checkFreeSpace) {
+  fixtures::TemporaryDirectory directory;
+  fixtures::PfsBuilder builder;
+  uint32_t ino = builder.add_file("big.bin", fixtures::random_data(100, 6));
+  builder.add_link("data/copy.bin", "big.bin");
+  std::vector<unsigned char> data = builder.build();
+
+  // Claims far more than any output device holds, the check runs on the manifest alone
+  uint64_t huge = 1ULL << 50;
+  std::memcpy(&data[0x1000 + ino * sizeof(pfs::di_d32) + offsetof(pfs::di_d32, size)], &huge, sizeof(huge));
+  std::string image_path = directory.get_path("image.dat");
+  fixtures::write_file(image_path, data);
+
+  pfs::extract_options options;
+  options.check_free_space = true;
+  pfs::Image image(image_path);
+  EXPECT_EXCEPTION_REGEX(image.dump(directory.get_path("copied"), options), "^Error: Not enough free space on the output device! Needed: 2251799813685248 \\| Available: \\d* at \"pfs\\.cpp\":\\d*:\\(dump\\)$", "Copied past the free space of the output device");
+  EXPECT_FALSE(std::filesystem::exists(directory.get_path("copied/data"))); // Fails before anything is written
+
+  // The link to a copy needs no space of its own
+  options.link_duplicates = true;
+  EXPECT_EXCEPTION_REGEX(image.dump(directory.get_path("linked"), options), "^Error: Not enough free space on the output device! Needed: 1125899906842624 \\| Available: \\d* at \"pfs\\.cpp\":\\d*:\\(dump\\)$", "Counted a linked duplicate as a copy");
+}
+
+TEST(pfsTests, prune) {
+  fixtures::TemporaryDirectory directory;
+  fixtures::PfsBuilder builder;
+  std::map<std::string, std::vector<unsigned char>> files = pfs_test_files();
+  for (auto &&file : files) {
+    builder.add_file(file.first, file.second);
+  }
+  builder.add_file("junk/a.bin", fixtures::random_data(100, 5));
+  std::vector<unsigned char> data = builder.build();
+
+  // Garbage over the listing of "junk", reading it at all fails
+  std::string image_path = directory.get_path("image.dat");
+  fixtures::write_file(image_path, data);
+  uint64_t junk_block;
+  {
+    pfs::Image image(image_path);
+    junk_block = image.find("junk")->first_block;
+  }
+  std::fill(data.begin() + junk_block * 0x1000, data.begin() + (junk_block + 1) * 0x1000, 0xFF);
+  fixtures::write_file(image_path, data);
+  pfs::Image broken(image_path);
+  EXPECT_ANY_THROW(broken.build_manifest());
+
+  // Root anchored names and directories never touch it
+  pfs::extract_options options;
+  options.include_paths = {"sce_sys/", "eboot.bin"};
+  pfs::Image image(image_path);
+  image.dump(directory.get_path("output"), options);
+  pfs_test_compare(directory.get_path("output"), {{"eboot.bin", files["eboot.bin"]}, {"sce_sys/param.sfo", files["sce_sys/param.sfo"]}, {"sce_sys/icon0.png", files["sce_sys/icon0.png"]}});
+  EXPECT_FALSE(std::filesystem::exists(directory.get_path("output/data")));
 }
 
 TEST(pfsTests, extract) {
-  // TODO
+  fixtures::TemporaryDirectory directory;
+  std::map<std::string, std::vector<unsigned char>> expected = pfs_test_files();
+  expected["data/link.bin"] = expected["eboot.bin"];
+
+  pfs::extract(pfs_test_image(directory), directory.get_path("output"));
+  pfs_test_compare(directory.get_path("output"), expected);
 }
 
 #endif // DUMPER_TESTS_PFS_TEST_H_
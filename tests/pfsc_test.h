@@ -0,0 +1,182 @@
+// Copyright (c) 2021 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_TESTS_PFSC_TEST_H_
+#define DUMPER_TESTS_PFSC_TEST_H_
+
+#include "pfsc.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "fixtures.h"
+#include "pfs.h"
+#include "testing.h"
+
+#define PFSC_TEST_BLOCK_SIZE 0x1000
+
+// Compressible, incompressible, an odd zero block stored empty, an even zero block stored compressed and a short last block
+static std::vector<unsigned char> pfsc_test_data() {
+  std::vector<unsigned char> data(2 * PFSC_TEST_BLOCK_SIZE, 'A');
+  std::vector<unsigned char> noise = fixtures::random_data(2 * PFSC_TEST_BLOCK_SIZE, 7);
+  data.insert(data.end(), noise.begin(), noise.end());
+  data.resize(data.size() + 2 * PFSC_TEST_BLOCK_SIZE, 0);
+  for (size_t i = 0; i < 1000; i++) {
+    data.push_back(static_cast<unsigned char>(i / 10));
+  }
+  return data;
+}
+
+static pfsc::reader pfsc_test_reader(const std::vector<unsigned char> &stream) {
+  return [&stream](void *buffer, size_t size, uint64_t offset) {
+    if (offset > stream.size() || size > stream.size() - offset) {
+      FATAL_ERROR("Read past the end of the test stream!");
+    }
+    std::memcpy(buffer, &stream[offset], size);
+  };
+}
+
+TEST(pfscTests, isPfsc) {
+  std::vector<unsigned char> stream = fixtures::make_pfsc(pfsc_test_data(), PFSC_TEST_BLOCK_SIZE);
+  EXPECT_TRUE(pfsc::is_pfsc(pfsc_test_reader(stream)));
+
+  std::vector<unsigned char> plain = pfsc_test_data();
+  EXPECT_FALSE(pfsc::is_pfsc(pfsc_test_reader(plain)));
+}
+
+TEST(pfscTests, inflateBlock) {
+  std::vector<unsigned char> data = fixtures::random_data(100, 1);
+  data.resize(3000, 'B');
+
+  // zlib wrapped
+  uLongf compressed_size = compressBound(data.size());
+  std::vector<unsigned char> compressed(compressed_size);
+  ASSERT_EQ(Z_OK, compress2(compressed.data(), &compressed_size, data.data(), data.size(), 6));
+  compressed.resize(compressed_size);
+  std::vector<unsigned char> output;
+  pfsc::inflate_block(compressed, output, data.size());
+  EXPECT_TRUE(data == output);
+
+  // Raw deflate, no zlib header or trailer
+  z_stream stream = {};
+  ASSERT_EQ(Z_OK, deflateInit2(&stream, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY));
+  std::vector<unsigned char> raw(deflateBound(&stream, data.size()));
+  stream.next_in = data.data();
+  stream.avail_in = data.size();
+  stream.next_out = raw.data();
+  stream.avail_out = raw.size();
+  ASSERT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  raw.resize(stream.total_out);
+  deflateEnd(&stream);
+  pfsc::inflate_block(raw, output, data.size());
+  EXPECT_TRUE(data == output);
+
+  // Output of another size than the block holds
+  EXPECT_EXCEPTION_REGEX(pfsc::inflate_block(compressed, output, data.size() - 1), "^Error: Error decompressing PFSC block! at \"pfsc\\.cpp\":\\d*:\\(inflate_block\\)$", "Accepted a block larger than its output");
+  EXPECT_EXCEPTION_REGEX(pfsc::inflate_block(compressed, output, data.size() + 1), "^Error: Error decompressing PFSC block! at \"pfsc\\.cpp\":\\d*:\\(inflate_block\\)$", "Accepted a block smaller than its output");
+
+  // Garbage
+  std::vector<unsigned char> garbage(100, 0xFF);
+  EXPECT_EXCEPTION_REGEX(pfsc::inflate_block(garbage, output, data.size()), "^Error: Error decompressing PFSC block! at \"pfsc\\.cpp\":\\d*:\\(inflate_block\\)$", "Inflated garbage");
+}
+
+TEST(pfscTests, stream) {
+  std::vector<unsigned char> data = pfsc_test_data();
+  std::vector<unsigned char> compressed = fixtures::make_pfsc(data, PFSC_TEST_BLOCK_SIZE);
+  pfsc::Stream stream(pfsc_test_reader(compressed), compressed.size());
+  EXPECT_EQ(data.size(), stream.get_size());
+
+  // Random reads, many of them across one or more block boundaries
+  std::mt19937 generator(3);
+  for (uint32_t i = 0; i < 200; i++) {
+    uint64_t offset = generator() % data.size();
+    size_t size = generator() % std::min<uint64_t>(3 * PFSC_TEST_BLOCK_SIZE, data.size() - offset + 1);
+    std::vector<unsigned char> buffer(size);
+    stream.read(buffer.data(), buffer.size(), offset); // Flawfinder: ignore
+    EXPECT_EQ(0, std::memcmp(buffer.data(), &data[offset], size)) << "Offset: " << offset << " Size: " << size;
+  }
+
+  // Whole stream in one read
+  std::vector<unsigned char> buffer(data.size());
+  stream.read(buffer.data(), buffer.size(), 0); // Flawfinder: ignore
+  EXPECT_TRUE(data == buffer);
+
+  EXPECT_EXCEPTION_REGEX(stream.read(buffer.data(), 2, data.size() - 1), "^Error: Read past the end of the PFSC stream! at \"pfsc\\.cpp\":\\d*:\\(read\\)$", "Read past the end of the stream"); // Flawfinder: ignore
+
+  // Header and block table checks
+  std::vector<unsigned char> plain = pfsc_test_data();
+  EXPECT_EXCEPTION_REGEX(pfsc::Stream(pfsc_test_reader(plain), plain.size()), "^Error: Input is not PFSC compressed! at \"pfsc\\.cpp\":\\d*:\\(read_block_table\\)$", "Opened an uncompressed stream");
+  EXPECT_EXCEPTION_REGEX(pfsc::Stream(pfsc_test_reader(compressed), 0x10), "^Error: Input is not PFSC compressed! at \"pfsc\\.cpp\":\\d*:\\(read_block_table\\)$", "Opened a truncated stream");
+
+  std::vector<unsigned char> corrupt = compressed;
+  pfsc::PfscHeader header;
+  std::memcpy(&header, corrupt.data(), sizeof(header));
+  header.data_length = UINT64_MAX; // A block table far larger than the stream
+  std::memcpy(corrupt.data(), &header, sizeof(header));
+  EXPECT_EXCEPTION_REGEX(pfsc::Stream(pfsc_test_reader(corrupt), corrupt.size()), "^Error: Corrupt PFSC block table! at \"pfsc\\.cpp\":\\d*:\\(read_block_table\\)$", "Allocated a block table larger than the stream");
+
+  header.data_length = data.size();
+  header.block_size = PFSC_MAX_BLOCK_SIZE + 1;
+  std::memcpy(corrupt.data(), &header, sizeof(header));
+  EXPECT_EXCEPTION_REGEX(pfsc::Stream(pfsc_test_reader(corrupt), corrupt.size()), "^Error: Invalid PFSC block size! at \"pfsc\\.cpp\":\\d*:\\(read_block_table\\)$", "Accepted an oversized block size");
+}
+
+TEST(pfscTests, decompress) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> data = pfsc_test_data();
+  std::vector<unsigned char> compressed = fixtures::make_pfsc(data, PFSC_TEST_BLOCK_SIZE);
+
+  // Inline and threaded, with a window smaller and larger than the worker count
+  for (uint32_t workers : {1, 2, 8}) {
+    for (uint32_t inflight : {1, 3, 64}) {
+      for (bool sparse : {false, true}) {
+        std::string output_path = directory.get_path("output");
+        int fd = open(output_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644); // Flawfinder: ignore
+        ASSERT_GE(fd, 0);
+        uint64_t written = 0;
+        pfsc::decompress(pfsc_test_reader(compressed), compressed.size(), fd, workers, inflight, [&](uint64_t bytes) { written += bytes; }, sparse);
+        ASSERT_EQ(0, ftruncate(fd, data.size()));
+        close(fd);
+
+        EXPECT_EQ(data.size(), written);
+        EXPECT_TRUE(fixtures::read_file(output_path) == data) << "Workers: " << workers << " In flight: " << inflight << " Sparse: " << sparse; // Flawfinder: ignore
+      }
+    }
+  }
+
+  // A failing read surfaces on the calling thread instead of hanging the writer
+  std::vector<unsigned char> truncated(compressed.begin(), compressed.end() - 100);
+  int fd = open(directory.get_path("failed").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644); // Flawfinder: ignore
+  ASSERT_GE(fd, 0);
+  EXPECT_EXCEPTION_REGEX(pfsc::decompress(pfsc_test_reader(truncated), compressed.size(), fd, 4, 4), "^Error: Read past the end of the test stream!.*", "Decompressed a truncated stream");
+  close(fd);
+
+  // Compressed files of a PFS image come out decompressed, whole or through pfs::File
+  fixtures::PfsBuilder builder;
+  builder.add_compressed_file("compressed.bin", data, PFSC_TEST_BLOCK_SIZE);
+  builder.add_file("plain.bin", data);
+  builder.write(directory.get_path("image.dat"));
+  pfs::Image image(directory.get_path("image.dat"));
+  pfs::extract_options options;
+  options.worker_count = 2;
+  options.sparse = true;
+  image.dump(directory.get_path("dump"), options);
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("dump/compressed.bin")) == data); // Flawfinder: ignore
+  EXPECT_TRUE(fixtures::read_file(directory.get_path("dump/plain.bin")) == data);      // Flawfinder: ignore
+
+  pfs::File file = image.open("compressed.bin");
+  std::vector<unsigned char> buffer(data.size());
+  EXPECT_EQ(data.size(), file.pread(buffer.data(), buffer.size(), 0));
+  EXPECT_TRUE(data == buffer);
+}
+
+#endif // DUMPER_TESTS_PFSC_TEST_H_
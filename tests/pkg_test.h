@@ -8,6 +8,15 @@
 
 #include <gtest/gtest.h>
 
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "fixtures.h"
 #include "testing.h"
 
 TEST(pkgTest, getEntryNameByType) {
@@ -578,6 +587,109 @@ TEST(pkgTest, getEntryNameByType) {
   EXPECT_EQ("", pkg::get_entry_name_by_type(0x16F6));
 }
 
+TEST(pkgTest, package) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> digests = fixtures::random_data(0x200, 1);
+  std::vector<unsigned char> license = fixtures::random_data(1024, 2);
+  std::vector<unsigned char> param = fixtures::random_data(300, 3);
+  std::vector<unsigned char> icon = fixtures::random_data(70000, 4);
+
+  fixtures::PkgBuilder builder;
+  builder.set_content_id("UP0000-CUSA00000_00-TEST000000000000");
+  builder.add_entry(0x0001, digests);
+  builder.add_entry(0x0400, license, 0x80000000);
+  builder.add_entry(0x1000, param);
+  builder.add_entry(0x1200, icon);
+  builder.add_entry(0x1401, {});
+  builder.add_entry(0x1000, {1, 2, 3}); // Listed twice, the first one wins
+  builder.write(directory.get_path("valid.pkg"));
+
+  // Empty input arguments
+  EXPECT_EXCEPTION_REGEX(pkg::Package package(""), "^Error: Empty input path argument! at \"pkg\\.cpp\":\\d*:\\(Package\\)$", "Accepted empty argument");
+  EXPECT_EXCEPTION_REGEX(pkg::Package package(" \t"), "^Error: Empty input path argument! at \"pkg\\.cpp\":\\d*:\\(Package\\)$", "Accepted whitespace argument");
+
+  // Non-existant file or non-file object
+  EXPECT_EXCEPTION_REGEX(pkg::Package package(directory.get_path("doesNotExist.pkg")), "^Error: Input path does not exist or is not a file! at \"pkg\\.cpp\":\\d*:\\(Package\\)$", "Opened non-existant file");
+  EXPECT_EXCEPTION_REGEX(pkg::Package package(directory.get_path()), "^Error: Input path does not exist or is not a file! at \"pkg\\.cpp\":\\d*:\\(Package\\)$", "Opened non-file object as file");
+
+  // Broken header and entry table
+  std::vector<unsigned char> data = fixtures::read_file(directory.get_path("valid.pkg")); // Flawfinder: ignore
+  fixtures::write_file(directory.get_path("short.pkg"), std::vector<unsigned char>(data.begin(), data.begin() + sizeof(pkg::PkgHeader) - 1));
+  EXPECT_EXCEPTION_REGEX(pkg::Package package(directory.get_path("short.pkg")), "^Error: Error reading PKG header! at \"pkg\\.cpp\":\\d*:\\(Package\\)$", "Accepted a truncated header");
+  std::vector<unsigned char> broken = data;
+  broken[0] ^= 0xFF;
+  fixtures::write_file(directory.get_path("magic.pkg"), broken);
+  EXPECT_EXCEPTION_REGEX(pkg::Package package(directory.get_path("magic.pkg")), "^Error: Input path is not a PKG! at \"pkg\\.cpp\":\\d*:\\(Package\\)$", "Accepted a broken magic");
+  broken = data;
+  pkg::PkgHeader *header = reinterpret_cast<pkg::PkgHeader *>(&broken[0]);
+  header->entry_count = __builtin_bswap32(0x10000000);
+  fixtures::write_file(directory.get_path("table.pkg"), broken);
+  EXPECT_EXCEPTION_REGEX(pkg::Package package(directory.get_path("table.pkg")), "^Error: Error reading entry table! at \"pkg\\.cpp\":\\d*:\\(Package\\)$", "Accepted an entry table past the end of the file");
+
+  for (bool memory_map : {false, true}) {
+    pkg::Package package(directory.get_path("valid.pkg"), memory_map);
+    EXPECT_EQ(memory_map, package.is_memory_mapped());
+    EXPECT_STREQ("UP0000-CUSA00000_00-TEST000000000000", package.get_header().content_id);
+    EXPECT_EQ(6, package.get_entries().size());
+
+    // By id and by name, entries stay in file byte order
+    const pkg::PkgTableEntry *entry = package.find(0x0400);
+    ASSERT_NE(nullptr, entry);
+    EXPECT_EQ(0x80000000, __builtin_bswap32(entry->flags1));
+    EXPECT_EQ(license.size(), __builtin_bswap32(entry->size));
+    EXPECT_EQ(entry, package.find("license.dat"));
+    EXPECT_EQ(package.find(0x1000), package.find("param.sfo"));
+    EXPECT_EQ(&package.get_entries()[2], package.find(0x1000));
+    EXPECT_EQ(nullptr, package.find(0x1234));
+    EXPECT_EQ(nullptr, package.find("doesNotExist.dat"));
+
+    // Whole entries and ranges of them
+    EXPECT_TRUE(package.read_entry(0x1000) == param); // Flawfinder: ignore
+    EXPECT_TRUE(package.read_entry(0x1200) == icon);  // Flawfinder: ignore
+    EXPECT_TRUE(package.read_entry(0x1401).empty());  // Flawfinder: ignore
+    std::vector<unsigned char> buffer(1000);
+    EXPECT_EQ(buffer.size(), package.read_entry(0x1200, buffer.data(), buffer.size(), 5000)); // Flawfinder: ignore
+    EXPECT_EQ(0, std::memcmp(buffer.data(), &icon[5000], buffer.size()));
+    EXPECT_EQ(100, package.read_entry(0x1000, buffer.data(), buffer.size(), 200)); // Flawfinder: ignore
+    EXPECT_EQ(0, std::memcmp(buffer.data(), &param[200], 100));
+    EXPECT_EQ(0, package.read_entry(0x1000, buffer.data(), buffer.size(), param.size())); // Flawfinder: ignore
+    EXPECT_EXCEPTION_REGEX(package.read_entry(0x1234), "^Error: Entry not found in PKG! at \"pkg\\.cpp\":\\d*:\\(get_entry\\)$", "Read a missing entry"); // Flawfinder: ignore
+
+    // Views into the mapping
+    if (memory_map) {
+      Span<const unsigned char> view = package.get_entry_data(0x0001);
+      ASSERT_EQ(digests.size(), view.size());
+      EXPECT_EQ(0, std::memcmp(view.data(), digests.data(), view.size()));
+      EXPECT_EQ(data.size(), package.get_data().size());
+    } else {
+      EXPECT_EXCEPTION_REGEX(package.get_entry_data(0x0001), "^Error: Package is not memory mapped! at \"pkg\\.cpp\":\\d*:\\(get_entry_data\\)$", "Returned a view without a mapping");
+      EXPECT_EXCEPTION_REGEX(package.get_data(), "^Error: Package is not memory mapped! at \"pkg\\.cpp\":\\d*:\\(get_data\\)$", "Returned a view without a mapping");
+    }
+  }
+
+  // An entry pointing past the end of the file
+  broken = data;
+  pkg::PkgTableEntry *last = reinterpret_cast<pkg::PkgTableEntry *>(&broken[__builtin_bswap32(header->entry_table_offset) + 3 * sizeof(pkg::PkgTableEntry)]);
+  last->size = __builtin_bswap32(broken.size());
+  fixtures::write_file(directory.get_path("entry.pkg"), broken);
+  pkg::Package package(directory.get_path("entry.pkg"));
+  EXPECT_EXCEPTION_REGEX(package.read_entry(0x1200), "^Error: Error reading entry data! at \"pkg\\.cpp\":\\d*:\\(get_entry\\)$", "Read an entry past the end of the file"); // Flawfinder: ignore
+}
+
+TEST(pkgTest, getEntryTable) {
+  std::vector<unsigned char> buffer(sizeof(pkg::PkgHeader) + 2 * sizeof(pkg::PkgTableEntry));
+  pkg::PkgHeader *header = reinterpret_cast<pkg::PkgHeader *>(&buffer[0]);
+  header->entry_table_offset = __builtin_bswap32(sizeof(pkg::PkgHeader));
+  header->entry_count = __builtin_bswap32(2);
+
+  Span<const pkg::PkgTableEntry> entries;
+  EXPECT_FALSE(pkg::get_entry_table(&buffer[0], sizeof(pkg::PkgHeader) - 1, entries)); // Header cut short
+  EXPECT_FALSE(pkg::get_entry_table(&buffer[0], buffer.size() - 1, entries)); // Table cut short
+  EXPECT_TRUE(pkg::get_entry_table(&buffer[0], buffer.size(), entries)); // Valid
+  EXPECT_EQ(2, entries.size());
+  EXPECT_EQ(reinterpret_cast<const pkg::PkgTableEntry *>(&buffer[sizeof(pkg::PkgHeader)]), entries.data());
+}
+
 TEST(pkgTest, extract_sc0) {
   // Empty input arguments
   EXPECT_EXCEPTION_REGEX(pkg::extract_sc0("", "./tests/files/pkg/outputDirectory/"), "^Error: Empty input path argument! at \"pkg\\.cpp\":\\d*:\\(extract_sc0\\)$", "Accepted empty argument");          // Empty
@@ -628,4 +740,148 @@ TEST(pkgTest, extract_sc0) {
   // TODO: Success and verify files with known layout/digests
 }
 
+TEST(pkgTest, extractPfs) {
+  fixtures::TemporaryDirectory directory;
+  std::map<std::string, std::vector<unsigned char>> files;
+  files["eboot.bin"] = fixtures::random_data(5000, 1);
+  files["sce_sys/param.sfo"] = fixtures::random_data(100, 2);
+  files["data/big.bin"] = fixtures::random_data(20 * 0x1000 + 123, 3);
+
+  fixtures::PfsBuilder inner;
+  for (auto &&file : files) {
+    inner.add_file(file.first, file.second);
+  }
+  std::vector<unsigned char> image = inner.build();
+
+  auto check_output = [&](const std::string &output_path) {
+    for (auto &&file : files) {
+      EXPECT_TRUE(fixtures::read_file(output_path + "/" + file.first) == file.second) << file.first; // Flawfinder: ignore
+    }
+  };
+
+  // Image straight in the package
+  fixtures::PkgBuilder direct;
+  direct.set_pfs_image(image);
+  direct.write(directory.get_path("direct.pkg"));
+  pkg::extract_pfs(directory.get_path("direct.pkg"), directory.get_path("direct"));
+  check_output(directory.get_path("direct"));
+
+  // Outer image holding a plain pfs_image.dat, extracted in place out of the package
+  fixtures::PfsBuilder outer;
+  outer.add_file("pfs_image.dat", image);
+  fixtures::PkgBuilder nested;
+  nested.set_pfs_image(outer.build());
+  nested.write(directory.get_path("nested.pkg"));
+  for (bool memory_map : {false, true}) {
+    pfs::extract_options options;
+    options.memory_map = memory_map;
+    options.worker_count = 2;
+    std::string output_path = directory.get_path(memory_map ? "nestedMapped" : "nested");
+    pkg::extract_pfs(directory.get_path("nested.pkg"), output_path, options);
+    check_output(output_path);
+    EXPECT_FALSE(std::filesystem::exists(output_path + "/pfs_image.dat"));
+  }
+
+  // A compressed pfs_image.dat cannot be read in place
+  fixtures::PfsBuilder compressed;
+  compressed.add_compressed_file("pfs_image.dat", image);
+  fixtures::PkgBuilder packed;
+  packed.set_pfs_image(compressed.build());
+  packed.write(directory.get_path("compressed.pkg"));
+  EXPECT_EXCEPTION_REGEX(pkg::extract_pfs(directory.get_path("compressed.pkg"), directory.get_path("compressed")), "^Error: Nested PFS image is PFSC compressed, it cannot be extracted in place! at \"pkg\\.cpp\":\\d*:\\(extract_pfs\\)$", "Extracted a compressed nested image as opaque data");
+
+  // No image at all
+  fixtures::PkgBuilder empty;
+  empty.add_entry(0x1000, fixtures::random_data(300, 4));
+  empty.write(directory.get_path("empty.pkg"));
+  EXPECT_EXCEPTION_REGEX(pkg::extract_pfs(directory.get_path("empty.pkg"), directory.get_path("empty")), "^Error: PKG does not contain a PFS image! at \"pkg\\.cpp\":\\d*:\\(extract_pfs\\)$", "Extracted a package without a PFS image");
+}
+
+TEST(pkgTest, verify) {
+  fixtures::TemporaryDirectory directory;
+  fixtures::PkgBuilder builder;
+  builder.add_entry(0x0001, fixtures::random_data(0x200, 1));
+  builder.add_entry(0x0400, fixtures::random_data(64, 2));
+  builder.add_entry(0x1000, fixtures::random_data(300, 3));
+  builder.set_pfs_image(fixtures::random_data(3 * 0x100000 + 7, 4), 0x10000);
+  std::vector<unsigned char> data = builder.build();
+  fixtures::write_file(directory.get_path("valid.pkg"), data);
+
+  auto get_passed = [](const std::vector<pkg::verify_result> &results) {
+    std::map<std::string, bool> passed;
+    for (auto &&result : results) {
+      passed[result.name] = result.passed;
+    }
+    return passed;
+  };
+
+  std::vector<pkg::verify_result> results = pkg::verify(directory.get_path("valid.pkg"));
+  std::map<std::string, bool> passed = get_passed(results);
+  EXPECT_EQ(6, results.size());
+  for (auto &&name : {"sc_entries1", "sc_entries2", "digest_table", "body", "pfs_image", "pfs_signed"}) {
+    EXPECT_TRUE(passed[name]) << name;
+  }
+  for (auto &&result : results) {
+    EXPECT_GE(result.elapsed, 0.0);
+    EXPECT_GE(result.rate, 0.0);
+  }
+
+  // A flipped byte inside the image but past the signed part only fails the full image digest
+  const pkg::PkgHeader *header = reinterpret_cast<const pkg::PkgHeader *>(&data[0]);
+  std::vector<unsigned char> corrupt = data;
+  corrupt[__builtin_bswap64(header->pfs_image_offset) + __builtin_bswap32(header->pfs_signed_size) + 5] ^= 1;
+  fixtures::write_file(directory.get_path("image.pkg"), corrupt);
+  passed = get_passed(pkg::verify(directory.get_path("image.pkg")));
+  EXPECT_FALSE(passed["pfs_image"]);
+  EXPECT_TRUE(passed["pfs_signed"]);
+  EXPECT_TRUE(passed["body"]);
+  EXPECT_TRUE(passed["sc_entries1"]);
+
+  // Inside the signed part fails both
+  corrupt = data;
+  corrupt[__builtin_bswap64(header->pfs_image_offset) + 5] ^= 1;
+  fixtures::write_file(directory.get_path("signed.pkg"), corrupt);
+  passed = get_passed(pkg::verify(directory.get_path("signed.pkg")));
+  EXPECT_FALSE(passed["pfs_image"]);
+  EXPECT_FALSE(passed["pfs_signed"]);
+  EXPECT_TRUE(passed["body"]);
+
+  // An entry's data is covered by the body and sc_entries1 digests, the table rows by sc_entries2 as well
+  corrupt = data;
+  corrupt[__builtin_bswap32(reinterpret_cast<const pkg::PkgTableEntry *>(&data[__builtin_bswap32(header->entry_table_offset)])[2].offset)] ^= 1;
+  fixtures::write_file(directory.get_path("entry.pkg"), corrupt);
+  passed = get_passed(pkg::verify(directory.get_path("entry.pkg")));
+  EXPECT_FALSE(passed["sc_entries1"]);
+  EXPECT_TRUE(passed["sc_entries2"]);
+  EXPECT_TRUE(passed["digest_table"]);
+  EXPECT_FALSE(passed["body"]);
+  EXPECT_TRUE(passed["pfs_image"]);
+
+  corrupt = data;
+  corrupt[__builtin_bswap32(header->entry_table_offset) + 4] ^= 1;
+  fixtures::write_file(directory.get_path("table.pkg"), corrupt);
+  passed = get_passed(pkg::verify(directory.get_path("table.pkg")));
+  EXPECT_FALSE(passed["sc_entries1"]);
+  EXPECT_FALSE(passed["sc_entries2"]);
+
+  // A region past the end of the file is reported as failed, not read
+  corrupt = data;
+  reinterpret_cast<pkg::PkgHeader *>(&corrupt[0])->pfs_image_size = __builtin_bswap64(corrupt.size());
+  fixtures::write_file(directory.get_path("size.pkg"), corrupt);
+  passed = get_passed(pkg::verify(directory.get_path("size.pkg")));
+  EXPECT_FALSE(passed["pfs_image"]);
+  EXPECT_TRUE(passed["pfs_signed"]);
+
+  // No PFS image, nothing to check there
+  fixtures::PkgBuilder empty;
+  empty.add_entry(0x1000, fixtures::random_data(300, 5));
+  empty.write(directory.get_path("empty.pkg"));
+  passed = get_passed(pkg::verify(directory.get_path("empty.pkg")));
+  EXPECT_EQ(0, passed.count("pfs_image"));
+  EXPECT_EQ(0, passed.count("pfs_signed"));
+  EXPECT_EQ(0, passed.count("digest_table"));
+  EXPECT_TRUE(passed["sc_entries1"]);
+  EXPECT_TRUE(passed["body"]);
+}
+
 #endif // DUMPER_TESTS_PKG_TEST_H_
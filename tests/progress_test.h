@@ -0,0 +1,81 @@
+// Copyright (c) 2021 Al Azif
+// License: GPLv3
+
+#ifndef DUMPER_TESTS_PROGRESS_TEST_H_
+#define DUMPER_TESTS_PROGRESS_TEST_H_
+
+#include "progress.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "testing.h"
+
+TEST(progressTests, tracker) {
+  progress::Tracker tracker;
+  tracker.start(100, 2);
+
+  progress::snapshot state = tracker.sample();
+  EXPECT_EQ(state.bytes_done, 0);
+  EXPECT_EQ(state.bytes_total, 100);
+  EXPECT_EQ(state.files_done, 0);
+  EXPECT_EQ(state.files_total, 2);
+  EXPECT_EQ(state.current_file, "");
+
+  tracker.set_current("a/b.bin");
+  tracker.add_bytes(40);
+  tracker.add_bytes(60);
+  tracker.finish_file();
+  EXPECT_EQ(tracker.get_bytes_done(), 100);
+
+  state = tracker.sample();
+  EXPECT_EQ(state.bytes_done, 100);
+  EXPECT_EQ(state.files_done, 1);
+  EXPECT_EQ(state.current_file, "a/b.bin");
+  EXPECT_EQ(state.eta, 0);
+
+  // The name is copied, it outlives the string it was set from
+  {
+    std::string name("c/d.bin");
+    tracker.set_current(name);
+  }
+  EXPECT_EQ(tracker.sample().current_file, "c/d.bin");
+
+  tracker.start(10, 1);
+  EXPECT_EQ(tracker.get_bytes_done(), 0);
+  EXPECT_EQ(tracker.sample().current_file, "");
+}
+
+TEST(progressTests, sample) {
+  progress::Tracker tracker;
+  tracker.start(4000000, 1);
+
+  // Nothing copied yet, the rate is zero so there is no estimate
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  progress::snapshot state = tracker.sample();
+  EXPECT_EQ(state.rate, 0);
+  EXPECT_EQ(state.average_rate, 0);
+  EXPECT_LT(state.eta, 0);
+  EXPECT_GT(state.elapsed, 0);
+
+  tracker.add_bytes(1000000);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  state = tracker.sample();
+  EXPECT_EQ(state.bytes_done, 1000000);
+  EXPECT_GT(state.rate, 0);
+  EXPECT_GT(state.average_rate, 0);
+  EXPECT_LT(state.average_rate, state.rate);
+  EXPECT_GT(state.eta, 0);
+
+  // Remaining bytes over the average rate
+  EXPECT_NEAR(state.eta, 3.0 / state.average_rate, 1e-9);
+
+  tracker.add_bytes(3000000);
+  state = tracker.sample();
+  EXPECT_EQ(state.eta, 0);
+}
+
+#endif // DUMPER_TESTS_PROGRESS_TEST_H_
@@ -8,6 +8,12 @@
 
 #include <gtest/gtest.h>
 
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "fixtures.h"
 #include "testing.h"
 
 TEST(sfoTests, isSfo) {
@@ -42,6 +48,53 @@ TEST(sfoTests, read) {
   // TODO
 }
 
+TEST(sfoTests, parse) {
+  fixtures::TemporaryDirectory directory;
+  std::vector<unsigned char> title = {'T', 'i', 't', 'l', 'e', '\0'};
+  std::vector<unsigned char> attribute = {0x01, 0x00, 0x00, 0x00};
+  std::vector<sfo::SfoData> data;
+  data = sfo::add_data(sfo::build_data("TITLE", "utf-8", title.size(), 0x80, title), data);
+  data = sfo::add_data(sfo::build_data("ATTRIBUTE", "integer", attribute.size(), attribute.size(), attribute), data);
+  sfo::write(data, directory.get_path("param.sfo"));
+  std::vector<unsigned char> buffer = fixtures::read_file(directory.get_path("param.sfo")); // Flawfinder: ignore
+
+  // Entries come back in the order write() sorted them
+  std::vector<sfo::SfoData> parsed = sfo::parse(buffer.data(), buffer.size());
+  ASSERT_EQ(2, parsed.size());
+  EXPECT_EQ(std::vector<std::string>({"ATTRIBUTE", "TITLE"}), sfo::get_keys(parsed));
+  EXPECT_EQ(0x0404, sfo::get_format("ATTRIBUTE", parsed));
+  EXPECT_TRUE(sfo::get_value("ATTRIBUTE", parsed) == attribute);
+  EXPECT_EQ(0x0204, sfo::get_format("TITLE", parsed));
+  EXPECT_EQ(title.size(), sfo::get_length("TITLE", parsed));
+  EXPECT_EQ(0x80, sfo::get_max_length("TITLE", parsed));
+  EXPECT_TRUE(sfo::get_value("TITLE", parsed) == title);
+
+  // Truncated header and a buffer that is not a SFO
+  EXPECT_EXCEPTION_REGEX(sfo::parse(buffer.data(), sizeof(sfo::SfoHeader) - 1), "^Error: Error reading SFO header! at \"sfo\\.cpp\":\\d*:\\(parse\\)$", "Parsed a truncated header");
+  std::vector<unsigned char> zeroes(buffer.size(), 0);
+  EXPECT_EXCEPTION_REGEX(sfo::parse(zeroes.data(), zeroes.size()), "^Error: Input buffer is not a SFO! at \"sfo\\.cpp\":\\d*:\\(parse\\)$", "Parsed a buffer without the SFO magic");
+
+  // Entry table cut off by the end of the buffer
+  EXPECT_EXCEPTION_REGEX(sfo::parse(buffer.data(), sizeof(sfo::SfoHeader) + 16), "^Error: Error reading entry table! at \"sfo\\.cpp\":\\d*:\\(parse\\)$", "Parsed past the entry table");
+
+  // Key table past the end
+  std::vector<unsigned char> broken = buffer;
+  uint32_t past_end = buffer.size();
+  std::memcpy(&broken[offsetof(sfo::SfoHeader, key_table_offset)], &past_end, sizeof(past_end));
+  EXPECT_EXCEPTION_REGEX(sfo::parse(broken.data(), broken.size()), "^Error: Error reading key table! at \"sfo\\.cpp\":\\d*:\\(parse\\)$", "Parsed a key past the end of the buffer");
+
+  // Data of the first entry past the end
+  broken = buffer;
+  std::memcpy(&broken[sizeof(sfo::SfoHeader) + 12], &past_end, sizeof(past_end));
+  EXPECT_EXCEPTION_REGEX(sfo::parse(broken.data(), broken.size()), "^Error: Error reading data table! at \"sfo\\.cpp\":\\d*:\\(parse\\)$", "Parsed data past the end of the buffer");
+
+  // Data table offset that wraps a 32 bit sum
+  broken = buffer;
+  uint32_t wrap = 0xFFFFFFFF;
+  std::memcpy(&broken[offsetof(sfo::SfoHeader, data_table_offset)], &wrap, sizeof(wrap));
+  EXPECT_EXCEPTION_REGEX(sfo::parse(broken.data(), broken.size()), "^Error: Error reading data table! at \"sfo\\.cpp\":\\d*:\\(parse\\)$", "Parsed a wrapped data offset");
+}
+
 TEST(sfoTests, getKeys) {
   // TODO
 }